@@ -0,0 +1,77 @@
+#ifndef ALLOC_STATS_H
+#define ALLOC_STATS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.h"
+
+// Counting malloc & co., used by the file processing modules and the model so the viewer can
+// tell what a frame allocates. Counters are global and atomic, as TIMs are decoded on worker
+// threads. Allocations made by raylib are not counted.
+
+typedef struct {
+    u64 allocations; // malloc, calloc & realloc calls
+    u64 frees;
+    u64 bytes; // Requested by the allocations
+} AllocStats;
+
+AllocStats _allocStats = { 0 };
+int _allocForbidden = 0;
+
+void _AllocCount(u64 size) {
+    if (__atomic_load_n(&_allocForbidden, __ATOMIC_RELAXED))
+        panic("Allocation made while allocations are forbidden");
+
+    __atomic_fetch_add(&_allocStats.allocations, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&_allocStats.bytes, size, __ATOMIC_RELAXED);
+}
+
+void* CountedMalloc(u64 size) {
+    _AllocCount(size);
+    return malloc(size);
+}
+
+void* CountedCalloc(u64 count, u64 size) {
+    _AllocCount(count * size);
+    return calloc(count, size);
+}
+
+void* CountedRealloc(void* ptr, u64 size) {
+    _AllocCount(size);
+    return realloc(ptr, size);
+}
+
+void CountedFree(void* ptr) {
+    if (ptr)
+        __atomic_fetch_add(&_allocStats.frees, 1, __ATOMIC_RELAXED);
+    free(ptr);
+}
+
+// Totals since the program started
+AllocStats AllocGetStats(void) {
+    AllocStats stats;
+    stats.allocations = __atomic_load_n(&_allocStats.allocations, __ATOMIC_RELAXED);
+    stats.frees = __atomic_load_n(&_allocStats.frees, __ATOMIC_RELAXED);
+    stats.bytes = __atomic_load_n(&_allocStats.bytes, __ATOMIC_RELAXED);
+
+    return stats;
+}
+
+// Counted since an earlier AllocGetStats
+AllocStats AllocGetStatsSince(AllocStats since) {
+    AllocStats stats = AllocGetStats();
+    stats.allocations -= since.allocations;
+    stats.frees -= since.frees;
+    stats.bytes -= since.bytes;
+
+    return stats;
+}
+
+// While forbidden, a counted allocation panics; for code that must not allocate, like the
+// viewer's frame loop
+void AllocSetForbidden(int forbidden) {
+    __atomic_store_n(&_allocForbidden, forbidden, __ATOMIC_RELAXED);
+}
+
+#endif
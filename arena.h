@@ -0,0 +1,98 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "allocStats.h"
+#include "common.h"
+
+// Bump allocator over a chain of blocks. Nothing is freed on its own: an arena is reset, which
+// keeps its blocks for reuse, or destroyed along with everything allocated from it.
+
+#define ARENA_ALIGNMENT (16)
+#define ARENA_DEFAULT_BLOCK_SIZE (64 * 1024)
+
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    u64 size, used; // Of the data, which follows the header
+} ArenaBlock;
+
+#define _ARENA_HEADER_SIZE ((sizeof(ArenaBlock) + ARENA_ALIGNMENT - 1) & ~(u64)(ARENA_ALIGNMENT - 1))
+
+typedef struct {
+    ArenaBlock* first;
+    ArenaBlock* current; // Blocks after it are empty
+    u64 blockSize; // Larger allocations get a block of their own size
+} Arena;
+
+Arena* ArenaCreate(u64 blockSize) {
+    Arena* arena = (Arena*)CountedCalloc(1, sizeof(Arena));
+    arena->blockSize = blockSize;
+
+    return arena;
+}
+
+// Aligned to ARENA_ALIGNMENT, valid until the arena is reset or destroyed
+void* ArenaAlloc(Arena* arena, u64 size) {
+    size = (size + ARENA_ALIGNMENT - 1) & ~(u64)(ARENA_ALIGNMENT - 1);
+
+    // Blocks kept by ArenaReset are reused first
+    ArenaBlock* block = arena->current;
+    while (block && block->used + size > block->size && block->next) {
+        block = block->next;
+        arena->current = block;
+    }
+
+    if (block == NULL || block->used + size > block->size) {
+        u64 blockSize = MAX(arena->blockSize, size);
+
+        ArenaBlock* newBlock = (ArenaBlock*)CountedMalloc(_ARENA_HEADER_SIZE + blockSize);
+        if (newBlock == NULL)
+            panic("Failed to allocate an arena block");
+
+        newBlock->next = NULL;
+        newBlock->size = blockSize;
+        newBlock->used = 0;
+
+        if (block)
+            block->next = newBlock;
+        else
+            arena->first = newBlock;
+
+        block = arena->current = newBlock;
+    }
+
+    void* data = (u8*)block + _ARENA_HEADER_SIZE + block->used;
+    block->used += size;
+
+    return data;
+}
+
+void* ArenaCalloc(Arena* arena, u64 count, u64 size) {
+    void* data = ArenaAlloc(arena, count * size);
+    memset(data, 0, count * size);
+
+    return data;
+}
+
+// Drop every allocation, keeping the blocks
+void ArenaReset(Arena* arena) {
+    for (ArenaBlock* block = arena->first; block; block = block->next)
+        block->used = 0;
+
+    arena->current = arena->first;
+}
+
+void ArenaDestroy(Arena* arena) {
+    ArenaBlock* block = arena->first;
+    while (block) {
+        ArenaBlock* next = block->next;
+        CountedFree(block);
+        block = next;
+    }
+
+    CountedFree(arena);
+}
+
+#endif
@@ -0,0 +1,479 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <raylib.h>
+
+#include "binaryMap.h"
+#include "threadPool.h"
+
+#include "tmdProcess.h"
+#include "timProcess.h"
+
+#include "model.h"
+
+#include "common.h"
+
+// Headless conversion of TMD files to Wavefront OBJ. Nothing here initializes raylib (only its
+// CPU-side image functions are used), so it runs without a display.
+
+#define BATCH_VRAM_NAME "vram"
+
+typedef struct {
+    char* outDir;
+    u32 threadCount;
+
+    unsigned timCount;
+    char** timFiles;
+
+    unsigned inputCount;
+    char** inputs;
+} BatchArguments;
+
+typedef struct {
+    char* tmdPath;
+    char* objPath;
+} BatchJob;
+
+typedef struct {
+    BatchJob* jobs;
+    u32 jobCount;
+    u32 _jobCapacity;
+
+    int textured; // Reference the VRAM material from the OBJs?
+
+    // Updated atomically by the workers
+    u32 doneCount;
+    u32 failedCount;
+} BatchState;
+
+void _BatchUsage() {
+    printf(
+        "Usage: tmdd batch [-o <output dir>] [-j <threads>] <TMD files/dirs>... [-i <TIM files>...]\n"
+        "  <TMD files/dirs>   : TMD files to convert. Directories are searched\n"
+        "                       recursively for *.tmd files, skipping symlinked\n"
+        "                       subdirectories.\n"
+        "  -o <output dir>    : Where the OBJ files are written (default: current dir).\n"
+        "                       Files found in directories are named after their path\n"
+        "                       relative to it, with separators replaced by '_'.\n"
+        "                       Names that would clash get a numbered suffix.\n"
+        "  -j <threads>       : Number of worker threads (default: one per CPU).\n"
+        "  -i <TIM files>...  : TIM files composited into VRAM, written as " BATCH_VRAM_NAME ".png\n"
+        "                       and used as the texture of every converted model.\n"
+    );
+}
+
+BatchArguments _BatchParseArguments(int argc, char** argv) {
+    BatchArguments args = { 0 };
+    args.outDir = ".";
+    args.threadCount = ThreadPoolGetDefaultThreadCount();
+    args.timFiles = malloc(argc * sizeof(char*));
+    args.inputs = malloc(argc * sizeof(char*));
+
+    int opt;
+    while ((opt = getopt(argc, argv, "o:j:i:")) != -1) {
+        switch (opt) {
+            case 'o': {
+                args.outDir = optarg;
+            } break;
+            case 'j': {
+                int threadCount = atoi(optarg);
+                if (threadCount < 1) {
+                    fprintf(stderr, "Error: invalid thread count.\n");
+                    _BatchUsage();
+                    exit(1);
+                }
+                args.threadCount = threadCount;
+            } break;
+            case 'i': {
+                args.timFiles[args.timCount++] = optarg;
+                while (optind < argc && argv[optind][0] != '-')
+                    args.timFiles[args.timCount++] = argv[optind++];
+            } break;
+
+            default: {
+                _BatchUsage();
+                exit(1);
+            }
+        }
+    }
+
+    while (optind < argc)
+        args.inputs[args.inputCount++] = argv[optind++];
+
+    if (args.inputCount == 0) {
+        fprintf(stderr, "Error: no TMD files or directories were passed.\n");
+        _BatchUsage();
+        exit(1);
+    }
+
+    return args;
+}
+
+int _BatchIsDirectory(char* path) {
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+// Symlinked directories aren't walked, as one pointing to an ancestor would never end
+int _BatchIsSymlink(char* path) {
+#ifndef _WIN32
+    struct stat st;
+    return lstat(path, &st) == 0 && S_ISLNK(st.st_mode);
+#else
+    return 0;
+#endif
+}
+
+int _BatchHasTmdExtension(char* name) {
+    char* extension = strrchr(name, '.');
+    return extension && strcasecmp(extension, ".tmd") == 0;
+}
+
+char* _BatchJoinPath(char* dir, char* name) {
+    char* path = (char*)malloc(strlen(dir) + 1 + strlen(name) + 1);
+    sprintf(path, "%s/%s", dir, name);
+    return path;
+}
+
+// name is what the output is named after; its extension is dropped and separators flattened
+void _BatchAddJob(BatchState* state, char* tmdPath, char* name, char* outDir) {
+    if (state->jobCount == state->_jobCapacity) {
+        state->_jobCapacity = state->_jobCapacity ? state->_jobCapacity * 2 : 64;
+        state->jobs = (BatchJob*)realloc(state->jobs, state->_jobCapacity * sizeof(BatchJob));
+    }
+
+    char* objName = (char*)malloc(strlen(name) + sizeof(".obj"));
+    strcpy(objName, name);
+
+    char* extension = strrchr(objName, '.');
+    if (extension && extension != objName)
+        *extension = '\0';
+    for (char* c = objName; *c; c++) {
+        if (*c == '/' || *c == '\\')
+            *c = '_';
+    }
+    strcat(objName, ".obj");
+
+    BatchJob* job = state->jobs + state->jobCount++;
+    job->tmdPath = tmdPath;
+    job->objPath = _BatchJoinPath(outDir, objName);
+
+    free(objName);
+}
+
+// Walk dir recursively and add a job for every TMD file in it. rootLength is the length of the
+// path of the directory that was passed on the command line.
+void _BatchAddDirectory(BatchState* state, char* dir, u32 rootLength, char* outDir) {
+    DIR* dp = opendir(dir);
+    if (dp == NULL) {
+        fprintf(stderr, "Warning: could not open directory %s, skipping.\n", dir);
+        return;
+    }
+
+    struct dirent* entry;
+    while ((entry = readdir(dp)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        char* path = _BatchJoinPath(dir, entry->d_name);
+
+        if (_BatchIsDirectory(path)) {
+            if (_BatchIsSymlink(path))
+                fprintf(stderr, "Warning: not following symlinked directory %s.\n", path);
+            else
+                _BatchAddDirectory(state, path, rootLength, outDir);
+            free(path);
+        }
+        else if (_BatchHasTmdExtension(entry->d_name))
+            _BatchAddJob(state, path, path + rootLength + 1, outDir);
+        else
+            free(path);
+    }
+
+    closedir(dp);
+}
+
+// FNV-1a, case-insensitive as output names may be on a case-insensitive file system
+u32 _BatchHashName(char* name) {
+    u32 hash = 2166136261u;
+    for (char* c = name; *c; c++) {
+        hash ^= (u8)tolower((u8)*c);
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+// Index of the job in table whose output path is path, or the empty slot it would go in
+u32 _BatchFindName(BatchState* state, u32* table, u32 tableSize, char* path) {
+    u32 h = _BatchHashName(path) & (tableSize - 1);
+    while (table[h] && strcasecmp(state->jobs[table[h] - 1].objPath, path) != 0)
+        h = (h + 1) & (tableSize - 1);
+
+    return h;
+}
+
+// Flattening separators and taking basenames can map different inputs to the same OBJ; give
+// every job after the first to claim a path a free numbered one instead
+void _BatchDisambiguateOutputs(BatchState* state) {
+    // Open addressing, kept at most half full; holds job index + 1, 0 when empty
+    u32 tableSize = 1;
+    while (tableSize < state->jobCount * 2)
+        tableSize <<= 1;
+    u32* table = (u32*)calloc(tableSize, sizeof(u32));
+
+    for (u32 i = 0; i < state->jobCount; i++) {
+        BatchJob* job = state->jobs + i;
+
+        u32 h = _BatchFindName(state, table, tableSize, job->objPath);
+        if (table[h]) {
+            BatchJob* owner = state->jobs + table[h] - 1;
+
+            // Room for "_<u32>"
+            u32 stemLength = strlen(job->objPath) - strlen(".obj");
+            char* path = (char*)malloc(stemLength + 11 + sizeof(".obj"));
+
+            for (u32 n = 2; table[h]; n++) {
+                sprintf(path, "%.*s_%u.obj", (int)stemLength, job->objPath, n);
+                h = _BatchFindName(state, table, tableSize, path);
+            }
+
+            fprintf(
+                stderr, "Warning: %s and %s would both be written to %s; writing the latter to %s.\n",
+                owner->tmdPath, job->tmdPath, owner->objPath, path
+            );
+
+            free(job->objPath);
+            job->objPath = path;
+        }
+
+        table[h] = i + 1;
+    }
+
+    free(table);
+}
+
+// Returns what went wrong, or NULL on success
+const char* _BatchWriteObj(ModelData* model, char* path, int textured) {
+    FILE* fp = fopen(path, "w");
+    if (fp == NULL)
+        return "The OBJ file could not be created.";
+
+    if (textured)
+        fprintf(fp, "mtllib " BATCH_VRAM_NAME ".mtl\n");
+
+    // Positions are written with the model transform applied, so the OBJ has the same
+    // orientation and scale as the viewer
+    const float scale = -MODEL_SCALE;
+
+    u32 indexBase = 1;
+    for (unsigned i = 0; i < ModelGetObjectCount(model); i++) {
+        fprintf(fp, "o object%u\n", i);
+        if (textured)
+            fprintf(fp, "usemtl " BATCH_VRAM_NAME "\n");
+
+        // Objects too large for one mesh are split over several
+        u32 firstMesh, endMesh;
+        ModelGetObjectMeshRange(model, i, &firstMesh, &endMesh);
+
+        for (u32 m = firstMesh; m < endMesh; m++) {
+            Mesh* mesh = model->rModel->meshes + m;
+
+            for (int v = 0; v < mesh->vertexCount; v++) {
+                float* position = mesh->vertices + v * 3;
+                u8* color = mesh->colors + v * 4;
+
+                fprintf(
+                    fp, "v %g %g %g %g %g %g\n",
+                    position[0] * scale, position[1] * scale, position[2] * scale,
+                    color[0] / 255.f, color[1] / 255.f, color[2] / 255.f
+                );
+            }
+            for (int v = 0; v < mesh->vertexCount; v++) {
+                float* texcoord = mesh->texcoords + v * 2;
+                fprintf(fp, "vt %g %g\n", texcoord[0], 1.f - texcoord[1]);
+            }
+            for (int v = 0; v < mesh->vertexCount; v++) {
+                float* normal = mesh->normals + v * 3;
+                fprintf(fp, "vn %g %g %g\n", -normal[0], -normal[1], -normal[2]);
+            }
+
+            for (int t = 0; t < mesh->triangleCount; t++) {
+                u32 a = mesh->indices[t * 3 + 0] + indexBase;
+                u32 b = mesh->indices[t * 3 + 1] + indexBase;
+                u32 c = mesh->indices[t * 3 + 2] + indexBase;
+
+                // Lines are stored as degenerate triangles
+                if (b == c)
+                    fprintf(fp, "l %u %u\n", a, b);
+                else
+                    fprintf(fp, "f %u/%u/%u %u/%u/%u %u/%u/%u\n", a, a, a, b, b, b, c, c, c);
+            }
+
+            indexBase += mesh->vertexCount;
+        }
+    }
+
+    if (fclose(fp) != 0) {
+        remove(path);
+        return "The OBJ file could not be written.";
+    }
+
+    return NULL;
+}
+
+// A file that cannot be read, is malformed or cannot be written is reported and counted, and
+// the batch carries on
+void _BatchConvert(void* user, u32 jobIndex) {
+    BatchState* state = (BatchState*)user;
+    BatchJob* job = state->jobs + jobIndex;
+
+    panicContext = job->tmdPath;
+
+    BinaryView tmdBinary;
+    const char* error = BinaryTryMap(job->tmdPath, &tmdBinary);
+    if (error == NULL)
+        error = TmdValidate(tmdBinary.data, tmdBinary.size);
+
+    if (error == NULL) {
+        ModelData* model = ModelBuild(tmdBinary.data, tmdBinary.size);
+        error = _BatchWriteObj(model, job->objPath, state->textured);
+
+        ModelDestroy(model);
+    }
+
+    BinaryUnmap(&tmdBinary);
+
+    panicContext = NULL;
+
+    if (error) {
+        __atomic_add_fetch(&state->failedCount, 1, __ATOMIC_RELAXED);
+        fprintf(stderr, "Error (%s): %s\n", job->tmdPath, error);
+        return;
+    }
+
+    u32 doneCount = __atomic_add_fetch(&state->doneCount, 1, __ATOMIC_RELAXED);
+    printf("[%u/%u] %s -> %s\n", doneCount, state->jobCount, job->tmdPath, job->objPath);
+}
+
+// Composite the TIM files into VRAM and write it out along with the material the OBJs use
+void _BatchWriteVram(BatchArguments* args) {
+    printf("Load & process TIM binaries ..");
+
+    Image iMat = { 0 };
+    iMat.format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8;
+    iMat.width = VR_WIDTH32;
+    iMat.height = VR_HEIGHT;
+    iMat.data = calloc(iMat.width * iMat.height, 4);
+    iMat.mipmaps = 1;
+
+    BinaryView* timBinaries = (BinaryView*)malloc(args->timCount * sizeof(BinaryView));
+    u8** timDatas = (u8**)malloc(args->timCount * sizeof(u8*));
+
+    for (unsigned i = 0; i < args->timCount; i++) {
+        panicContext = args->timFiles[i];
+
+        timBinaries[i] = BinaryMap(args->timFiles[i]);
+
+        TimPreprocess(timBinaries[i].data, timBinaries[i].size);
+
+        timDatas[i] = timBinaries[i].data;
+    }
+    panicContext = NULL;
+
+    TimVrCopyMany(timDatas, args->timCount, (u8*)iMat.data, args->threadCount);
+
+    for (unsigned i = 0; i < args->timCount; i++)
+        BinaryUnmap(timBinaries + i);
+
+    free(timBinaries);
+    free(timDatas);
+
+    LOG_OK;
+
+    char* pngPath = _BatchJoinPath(args->outDir, BATCH_VRAM_NAME ".png");
+    if (!ExportImage(iMat, pngPath))
+        panic("The VRAM image could not be written.");
+    free(pngPath);
+
+    char* mtlPath = _BatchJoinPath(args->outDir, BATCH_VRAM_NAME ".mtl");
+    FILE* fp = fopen(mtlPath, "w");
+    if (fp == NULL)
+        panic("The MTL file could not be created.");
+    fprintf(fp, "newmtl " BATCH_VRAM_NAME "\nmap_Kd " BATCH_VRAM_NAME ".png\n");
+    fclose(fp);
+    free(mtlPath);
+
+    UnloadImage(iMat);
+}
+
+int BatchRun(int argc, char** argv) {
+    BatchArguments args = _BatchParseArguments(argc, argv);
+
+    SetTraceLogLevel(LOG_WARNING);
+
+#ifdef _WIN32
+    int madeDir = mkdir(args.outDir);
+#else
+    int madeDir = mkdir(args.outDir, 0755);
+#endif
+    if (madeDir != 0 && errno != EEXIST)
+        panic("The output directory could not be created.");
+
+    BatchState state = { 0 };
+    state.textured = args.timCount != 0;
+
+    for (unsigned i = 0; i < args.inputCount; i++) {
+        char* input = args.inputs[i];
+
+        if (_BatchIsDirectory(input))
+            _BatchAddDirectory(&state, input, strlen(input), args.outDir);
+        else {
+            char* name = strrchr(input, '/');
+            name = name ? name + 1 : input;
+
+            // Owned by the job like the paths found in directories
+            char* path = (char*)malloc(strlen(input) + 1);
+            strcpy(path, input);
+
+            _BatchAddJob(&state, path, path + (name - input), args.outDir);
+        }
+    }
+
+    _BatchDisambiguateOutputs(&state);
+
+    if (state.textured)
+        _BatchWriteVram(&args);
+
+    printf("Converting %u TMD files on %u threads ..\n", state.jobCount, MIN(args.threadCount, state.jobCount));
+
+    ThreadPoolRun(args.threadCount, state.jobCount, _BatchConvert, &state);
+
+    printf("\nAll done. Converted %u TMD files.\n", state.doneCount);
+    if (state.failedCount)
+        fprintf(stderr, "%u TMD files could not be converted.\n", state.failedCount);
+
+    for (unsigned i = 0; i < state.jobCount; i++) {
+        free(state.jobs[i].tmdPath);
+        free(state.jobs[i].objPath);
+    }
+    free(state.jobs);
+
+    free(args.timFiles);
+    free(args.inputs);
+
+    return state.failedCount ? 1 : 0;
+}
+
+#endif
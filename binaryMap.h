@@ -0,0 +1,128 @@
+#ifndef BINARY_MAP_H
+#define BINARY_MAP_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "common.h"
+
+// Read-only view of a binary file. Where available the file is memory-mapped so that only
+// the pages actually touched get faulted in; otherwise it is read into a heap buffer.
+// The data must never be written to.
+typedef struct {
+    u8* data;
+    u64 size;
+
+    int _mapped; // Was the view created with mmap?
+} BinaryView;
+
+const char* _BinaryRead(char* path, BinaryView* view) {
+    FILE* fpBin = fopen(path, "rb");
+    if (fpBin == NULL)
+        return "The binary could not be opened.";
+
+    fseek(fpBin, 0, SEEK_END);
+    view->size = ftell(fpBin);
+    rewind(fpBin);
+
+    if (view->size == 0) {
+        fclose(fpBin);
+
+        return "The binary is empty.";
+    }
+
+    view->data = (u8*)malloc(view->size);
+    if (view->data == NULL) {
+        fclose(fpBin);
+
+        return "Failed to allocate bin buf";
+    }
+
+    u64 bytesCopied = fread(view->data, 1, view->size, fpBin);
+    if (bytesCopied != view->size) {
+        free(view->data);
+        view->data = NULL;
+        fclose(fpBin);
+
+        return "Buffer readin fail";
+    }
+
+    fclose(fpBin);
+
+    return NULL;
+}
+
+// Like BinaryMap, but returns what went wrong (NULL on success) rather than panicking, for
+// callers that carry on with other files
+const char* BinaryTryMap(char* path, BinaryView* view) {
+    BinaryView empty = { 0 };
+    *view = empty;
+
+#ifndef _WIN32
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return "The binary could not be opened.";
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+
+        return "The binary could not be stat'd.";
+    }
+    if (st.st_size == 0) {
+        close(fd);
+
+        return "The binary is empty.";
+    }
+
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    // The mapping holds its own reference to the file
+    close(fd);
+
+    if (data != MAP_FAILED) {
+        view->data = (u8*)data;
+        view->size = st.st_size;
+        view->_mapped = 1;
+
+        return NULL;
+    }
+#endif
+
+    // Not mappable (e.g. a pipe), read it in instead
+    return _BinaryRead(path, view);
+}
+
+BinaryView BinaryMap(char* path) {
+    BinaryView view;
+
+    const char* error = BinaryTryMap(path, &view);
+    if (error)
+        panic(error);
+
+    return view;
+}
+
+void BinaryUnmap(BinaryView* view) {
+    if (view->data == NULL)
+        return;
+
+#ifndef _WIN32
+    if (view->_mapped)
+        munmap(view->data, view->size);
+    else
+#endif
+        free(view->data);
+
+    view->data = NULL;
+    view->size = 0;
+}
+
+#endif
@@ -17,8 +17,14 @@ typedef char s8;
 
 #define LOG_OK printf(" OK\n")
 
+// What the current thread is working on (e.g. a file path), reported by panic when set
+_Thread_local const char* panicContext = NULL;
+
 void panic(const char* msg) {
-    fprintf(stderr, "\nPANIC: %s\nExiting ..\n", msg);
+    if (panicContext)
+        fprintf(stderr, "\nPANIC (%s): %s\nExiting ..\n", panicContext, msg);
+    else
+        fprintf(stderr, "\nPANIC: %s\nExiting ..\n", msg);
     exit(1);
 }
 
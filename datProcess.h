@@ -2,9 +2,11 @@
 #define DAT_PROCESS_H
 
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "vdfProcess.h"
 
+#include "allocStats.h"
 #include "common.h"
 
 typedef struct __attribute((packed)) {
@@ -17,54 +19,114 @@ typedef struct __attribute((packed)) {
     DatKey firstKey[0];
 } DatFileHeader;
 
-void DatPreprocess(u8* datData) {}
+// Keys x frames is capped so a small file can't request a huge curve table
+#define DAT_MAX_CURVE_ENTRIES (1 << 24)
 
-u32 DatGetFrameCount(u8* datData) {
-    DatFileHeader* fileHeader = (DatFileHeader*)datData;
+// Influence curves of all keys, sampled per frame. Rows are frame-major (keyCount floats per
+// frame), so a frame is evaluated for every key with one contiguous lerp:
+//     influence = values[frame][key] + t * slopes[frame][key]
+// Frames past the end of a key have a value and slope of 0.
+typedef struct {
+    u8* _datData;
 
+    u32 keyCount;
+    u32 frameCount; // Of the longest key
+
+    float* values;
+    float* slopes;
+} DatData;
+
+float _DatFixedPointToFloat(s16 fixedPoint) {
+    return fixedPoint / 4096.0f;
+}
+
+// Validates the key chain against the file size and builds the curve table
+DatData* DatPreprocess(u8* datData, u64 datDataSize) {
+    if (datDataSize < sizeof(DatFileHeader))
+        panic("DAT file is too small");
+
+    u16 keyCount = ((DatFileHeader*)datData)->keyCount;
     u32 frameCount = 0;
 
-    DatKey* currentKey = fileHeader->firstKey;
-    for (unsigned i = 0; i < fileHeader->keyCount; i++) {
-        if (currentKey->frameCount > frameCount)
-            frameCount = currentKey->frameCount;
+    u64 keyOffset = sizeof(DatFileHeader);
+    for (unsigned i = 0; i < keyCount; i++) {
+        if (datDataSize - keyOffset < sizeof(DatKey))
+            panic("DAT key header is out of bounds");
+
+        DatKey* key = (DatKey*)(datData + keyOffset);
+        keyOffset += sizeof(DatKey);
+
+        if ((datDataSize - keyOffset) / sizeof(u16) < key->frameCount)
+            panic("DAT key frames are out of bounds");
+
+        keyOffset += (u64)key->frameCount * sizeof(u16);
+
+        frameCount = MAX(frameCount, key->frameCount);
+    }
+
+    if ((u64)keyCount * frameCount > DAT_MAX_CURVE_ENTRIES)
+        panic("DAT curve table is too large");
+
+    DatData* dat = (DatData*)CountedMalloc(sizeof(DatData));
+    dat->_datData = datData;
+    dat->keyCount = keyCount;
+    dat->frameCount = frameCount;
+
+    u64 entryCount = (u64)keyCount * frameCount;
+    dat->values = (float*)CountedCalloc(entryCount, sizeof(float));
+    dat->slopes = (float*)CountedCalloc(entryCount, sizeof(float));
+
+    DatKey* currentKey = ((DatFileHeader*)datData)->firstKey;
+    for (unsigned k = 0; k < keyCount; k++) {
+        for (unsigned f = 0; f < currentKey->frameCount; f++) {
+            float value = _DatFixedPointToFloat(currentKey->frames[f]);
+            float next = _DatFixedPointToFloat(currentKey->frames[MIN(f + 1, currentKey->frameCount - 1u)]);
+
+            dat->values[f * keyCount + k] = value;
+            dat->slopes[f * keyCount + k] = next - value;
+        }
+
         currentKey = (DatKey*)((u8*)(currentKey + 1) + (currentKey->frameCount * 2));
     }
 
-    return frameCount;
+    return dat;
 }
 
-float _DatFixedPointToFloat(s16 fixedPoint) {
-    return fixedPoint / 4096.0f;
-}
+void DatDestroy(DatData* dat) {
+    CountedFree(dat->values);
+    CountedFree(dat->slopes);
 
-float _DatGetInfluenceAtFrame(DatKey* key, float frameNo) {
-    unsigned frameLow = (int)frameNo;
-    unsigned frameHigh = frameLow + 1;
-    float t = frameNo - frameLow;
+    CountedFree(dat);
+}
 
-    float influenceLow = _DatFixedPointToFloat(
-        key->frames[MIN(frameLow, key->frameCount - 1)]
-    );
-    float influenceHigh = _DatFixedPointToFloat(
-        key->frames[MIN(frameHigh, key->frameCount - 1)]
-    );
+u32 DatGetFrameCount(DatData* dat) {
+    return dat->frameCount;
+}
 
-    return influenceLow + t * (influenceHigh - influenceLow);
+u32 DatGetKeyCount(DatData* dat) {
+    return dat->keyCount;
 }
 
-void DatApplyVdf(u8* datData, u8* vdfData, TmdVertex* vertices, float frameNo) {
-    DatFileHeader* fileHeader = (DatFileHeader*)datData;
+// Get the influence of every key at a frame; keys that have ended get an influence of 0.
+// influences holds influenceCount entries, the ones without a matching DAT key are zeroed.
+void DatGetInfluences(DatData* dat, float frameNo, float* influences, u32 influenceCount) {
+    u32 keyCount = MIN(dat->keyCount, influenceCount);
 
-    DatKey* currentKey = fileHeader->firstKey;
-    for (unsigned i = 0; i < fileHeader->keyCount; i++) {
-        if (frameNo < currentKey->frameCount) {
-            float influence = _DatGetInfluenceAtFrame(currentKey, frameNo);
-            VdfApply(vdfData, i, influence, vertices);
-        }
+    if (frameNo >= 0.f && frameNo < dat->frameCount) {
+        unsigned frame = (unsigned)frameNo;
+        float t = frameNo - frame;
 
-        currentKey = (DatKey*)((u8*)(currentKey + 1) + (currentKey->frameCount * 2));
+        const float* values = dat->values + (u64)frame * dat->keyCount;
+        const float* slopes = dat->slopes + (u64)frame * dat->keyCount;
+
+        for (unsigned i = 0; i < keyCount; i++)
+            influences[i] = values[i] + t * slopes[i];
     }
+    else
+        keyCount = 0;
+
+    for (unsigned i = keyCount; i < influenceCount; i++)
+        influences[i] = 0.f;
 }
 
 #endif
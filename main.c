@@ -1,17 +1,24 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <unistd.h>
 
 #include <raylib.h>
 #include <raymath.h>
 
+#include "binaryMap.h"
+
 #include "tmdProcess.h"
 #include "timProcess.h"
 #include "vdfProcess.h"
 #include "datProcess.h"
 
 #include "model.h"
+#include "vrTexture.h"
+
+#include "batch.h"
+#include "allocStats.h"
 
 #include "common.h"
 
@@ -19,36 +26,11 @@
 #define WINDOW_WIDTH (800)
 #define WINDOW_HEIGHT (600)
 
-void ReadBinary(char* path, u8** bufferOut, u64* sizeOut) {
-    FILE* fpBin = fopen(path, "rb");
-    if (fpBin == NULL)
-        panic("The binary could not be opened.");
-
-    fseek(fpBin, 0, SEEK_END);
-    u64 bufSize = ftell(fpBin);
-    rewind(fpBin);
-
-    u8* buffer = (u8 *)malloc(bufSize);
-    if (buffer == NULL) {
-        fclose(fpBin);
-
-        panic("Failed to allocate bin buf");
-    }
-
-    u64 bytesCopied = fread(buffer, 1, bufSize, fpBin);
-    if (bytesCopied != bufSize) {
-        free(buffer);
-        fclose(fpBin);
-
-        panic("Buffer readin fail");
-    }
-
-    fclose(fpBin);
-
-    *bufferOut = buffer;
-    if (sizeOut)
-        *sizeOut = bufSize;
-}
+typedef enum {
+    TEXTURE_MODE_VRAM, // TIMs decoded to an RGBA image of VRAM
+    TEXTURE_MODE_NATIVE, // Raw 16-bit VRAM, decoded by the shader
+    TEXTURE_MODE_CACHE // Only the (page, CLUT) combinations in use, decoded to an atlas
+} TextureMode;
 
 typedef struct {
     char* tmdFile;
@@ -58,18 +40,41 @@ typedef struct {
     char* vdfFile;
 
     char* datFile;
+
+    TextureMode textureMode;
+
+    int optimizeOverdraw;
+    int packed;
+    int compact;
+
+    int strictFrames; // Panic when a frame allocates
 } Arguments;
 
 void usage() {
     printf(
-        "Usage: tmdd -t <TMD file> [-i <TIM files>...] [-v <VDF file>] [-d <DAT file>]\n"
+        "Usage: tmdd -t <TMD file> [-i <TIM files>...] [-v <VDF file>] [-d <DAT file>] [-m <mode>] [-o] [-p] [-c] [-a]\n"
+        "       tmdd batch ... (headless conversion to OBJ, run 'tmdd batch' for usage)\n"
         "  -t <TMD file>      : Path to the TMD geometry file.\n"
         "  -i <TIM files>...  : All associated TIM texture files. If none are passed,\n"
         "                       the model will be displayed in wireframe mode.\n"
+        "                       Press R in the viewer to reload them.\n"
         "  -v <VDF file>      : Path to a VDF mime file (optional).\n"
         "  -d <DAT file>      : Path to a DAT animation file (optional).\n"
         "                       This file is exclusively present in Parappa the Rapper &\n"
         "                       Um Jammer Lammy.\n"
+        "  -m <mode>          : How textures are handled (optional):\n"
+        "                       vram   - TIMs are decoded to an RGBA image (default).\n"
+        "                       native - TIMs are kept as 16-bit VRAM and decoded by\n"
+        "                                the shader, using each primitive's CLUT.\n"
+        "                       cache  - Only the texture page & CLUT combinations\n"
+        "                                the model uses are decoded, to an atlas.\n"
+        "                                Falls back to native if they don't fit.\n"
+        "  -o                 : Also order triangles to reduce overdraw (optional).\n"
+        "  -p                 : Pack all objects into one vertex buffer, drawn with a\n"
+        "                       single call (optional).\n"
+        "  -c                 : Like -p, with vertices quantized to 24 bytes (optional).\n"
+        "  -a                 : Exit with an error if a frame allocates once loaded\n"
+        "                       (optional).\n"
     );
 }
 
@@ -78,7 +83,7 @@ Arguments parseArguments(int argc, char** argv) {
     args.timFiles = malloc(argc * sizeof(char*));
 
     int opt;
-    while ((opt = getopt(argc, argv, "t:i:v:d:")) != -1) {
+    while ((opt = getopt(argc, argv, "t:i:v:d:m:opca")) != -1) {
         switch (opt) {
             case 't': {
                 args.tmdFile = optarg;
@@ -94,6 +99,32 @@ Arguments parseArguments(int argc, char** argv) {
             case 'd': {
                 args.datFile = optarg;
             } break;
+            case 'm': {
+                if (strcmp(optarg, "vram") == 0)
+                    args.textureMode = TEXTURE_MODE_VRAM;
+                else if (strcmp(optarg, "native") == 0)
+                    args.textureMode = TEXTURE_MODE_NATIVE;
+                else if (strcmp(optarg, "cache") == 0)
+                    args.textureMode = TEXTURE_MODE_CACHE;
+                else {
+                    fprintf(stderr, "Error: unknown texture mode '%s'.\n", optarg);
+                    usage();
+                    exit(1);
+                }
+            } break;
+            case 'o': {
+                args.optimizeOverdraw = 1;
+            } break;
+            case 'p': {
+                args.packed = 1;
+            } break;
+            case 'c': {
+                args.packed = 1;
+                args.compact = 1;
+            } break;
+            case 'a': {
+                args.strictFrames = 1;
+            } break;
 
             default: {
                 usage();
@@ -111,7 +142,32 @@ Arguments parseArguments(int argc, char** argv) {
     return args;
 }
 
+void loadTims(Arguments* args, VrTexture* vrTexture) {
+    BinaryView* timBinaries = (BinaryView*)malloc(args->timCount * sizeof(BinaryView));
+    u8** timDatas = (u8**)malloc(args->timCount * sizeof(u8*));
+
+    for (unsigned i = 0; i < args->timCount; i++) {
+        timBinaries[i] = BinaryMap(args->timFiles[i]);
+
+        TimPreprocess(timBinaries[i].data, timBinaries[i].size);
+
+        timDatas[i] = timBinaries[i].data;
+    }
+
+    // Decoded concurrently, composited in argument order
+    VrTextureAddTims(vrTexture, timDatas, args->timCount, ThreadPoolGetDefaultThreadCount());
+
+    for (unsigned i = 0; i < args->timCount; i++)
+        BinaryUnmap(timBinaries + i);
+
+    free(timBinaries);
+    free(timDatas);
+}
+
 int main(int argc, char** argv) {
+    if (argc >= 2 && strcmp(argv[1], "batch") == 0)
+        return BatchRun(argc - 1, argv + 1);
+
     if (argc < 3) {
         usage();
         return 1;
@@ -123,41 +179,28 @@ int main(int argc, char** argv) {
     const int onlyVdf = !!args.vdfFile && !args.datFile;
     const int canAnimate = !!args.vdfFile && !onlyVdf;
 
-    u8* tmdData;
-    u64 tmdDataSize;
+    BinaryView tmdBinary;
 
-    u8* vdfData = NULL;
-    u8* datData = NULL;
+    BinaryView vdfBinary = { 0 };
+    BinaryView datBinary = { 0 };
 
-    printf("Read & copy TMD binary ..");
+    VdfData* vdf = NULL;
+    DatData* dat = NULL;
 
-    ReadBinary(args.tmdFile, &tmdData, &tmdDataSize);
+    printf("Map TMD binary ..");
 
-    TmdPreprocess(tmdData);
+    tmdBinary = BinaryMap(args.tmdFile);
+
+    TmdPreprocess(tmdBinary.data, tmdBinary.size);
 
     LOG_OK;
 
-    Image iMat = { 0 };
+    VrTexture* vrTexture = NULL;
     if (!noTexture) {
         printf("Load & process TIM binaries ..");
 
-        iMat.format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8;
-        iMat.width = VR_WIDTH32;
-        iMat.height = VR_HEIGHT;
-        iMat.data = calloc(iMat.width * iMat.height, 4);
-        iMat.mipmaps = 1;
-
-        for (unsigned i = 0; i < args.timCount; i++) {
-            u8* timData;
-            u64 timDataSize;
-            ReadBinary(args.timFiles[i], &timData, &timDataSize);
-
-            TimPreprocess(timData);
-
-            TimVrCopy(timData, (u8*)iMat.data);
-
-            free(timData);
-        }
+        vrTexture = VrTextureCreate(args.textureMode != TEXTURE_MODE_VRAM);
+        loadTims(&args, vrTexture);
 
         LOG_OK;
     }
@@ -165,8 +208,8 @@ int main(int argc, char** argv) {
     if (args.vdfFile) {
         printf("Load & process VDF ..");
 
-        ReadBinary(args.vdfFile, &vdfData, NULL);
-        VdfPreprocess(vdfData);
+        vdfBinary = BinaryMap(args.vdfFile);
+        vdf = VdfPreprocess(vdfBinary.data, vdfBinary.size);
 
         LOG_OK;
     }
@@ -174,8 +217,8 @@ int main(int argc, char** argv) {
     if (args.datFile) {
         printf("Load & process DAT ..");
 
-        ReadBinary(args.datFile, &datData, NULL);
-        DatPreprocess(datData);
+        datBinary = BinaryMap(args.datFile);
+        dat = DatPreprocess(datBinary.data, datBinary.size);
 
         LOG_OK;
     }
@@ -191,14 +234,44 @@ int main(int argc, char** argv) {
     camera.fovy = 45.0f;                                // Camera field-of-view Y
     camera.projection = CAMERA_PERSPECTIVE;             // Camera mode type
 
-    ModelData* model = ModelCreate(tmdData, tmdDataSize);
+    ModelData* model = ModelBuild(tmdBinary.data, tmdBinary.size);
+    if (args.optimizeOverdraw)
+        ModelOptimizeOverdraw(model);
+    if (args.packed)
+        ModelUploadPacked(model, args.compact ? MODEL_PACK_COMPACT : MODEL_PACK_FLOAT);
+    else
+        ModelUpload(model);
+
+    printf("Vertex cache ACMR: %.3f (%.3f in TMD order)\n", ModelGetAcmr(model), model->tmdOrderAcmr);
+
+    if (vdf)
+        ModelAttachVdf(model, vdf);
     if (noTexture) {
         ModelApplyDefaultMaterial(model);
         model->tint = BLACK;
     }
     else {
-        ModelApplyImageTexture(model, iMat);
-        UnloadImage(iMat);
+        int cached = 0;
+        if (args.textureMode == TEXTURE_MODE_CACHE) {
+            TexCache* cache = TexCacheCreate((u16*)vrTexture->image.data);
+            cached = ModelApplyCacheTexture(model, cache);
+
+            if (cached)
+                printf("Decoded %u texture page & CLUT combinations\n", cache->slotCount);
+            else
+                fprintf(stderr, "Warning: the texture page & CLUT combinations don't fit in the atlas, using the native VRAM mode instead.\n");
+
+            TexCacheDestroy(cache);
+        }
+
+        if (!cached) {
+            VrTextureUpload(vrTexture);
+
+            if (vrTexture->native)
+                ModelApplyVramTexture(model, vrTexture->texture);
+            else
+                ModelApplyTexture(model, vrTexture->texture);
+        }
     }
 
     SetTargetFPS(TARGET_FPS);
@@ -209,18 +282,27 @@ int main(int argc, char** argv) {
     int playing = 1;
 
     unsigned frameCount = 0;
-    if (datData)
-        frameCount = DatGetFrameCount(datData);
+    if (dat)
+        frameCount = DatGetFrameCount(dat);
     float currentFrame = 0.f;
 
     float animSpeed = 1.f;
 
     unsigned keyCount = 0;
-    if (vdfData)
-        keyCount = VdfGetKeyCount(vdfData);
+    if (vdf)
+        keyCount = VdfGetKeyCount(vdf);
     unsigned currentKey = 0;
 
+    AllocStats loadAllocs = AllocGetStats();
+    printf("Loading made %lu allocations (%lu KiB)\n", loadAllocs.allocations, loadAllocs.bytes / 1024);
+
+    // Only reloading TIMs may allocate from here on
+    AllocSetForbidden(args.strictFrames);
+    AllocStats frameAllocs = { 0 }; // Of the last frame
+
     while (!WindowShouldClose()) {
+        AllocStats frameStart = AllocGetStats();
+
         if (IsKeyPressed(KEY_U)) {
             if (cursorLocked) {
                 EnableCursor();
@@ -240,7 +322,7 @@ int main(int argc, char** argv) {
                     currentKey--;
 
                 ModelReset(model);
-                ModelApplyVdf(model, vdfData, currentKey, 1.f);
+                ModelApplyVdf(model, currentKey, 1.f);
                 ModelUpdate(model);
             }
             else if (canAnimate)
@@ -254,7 +336,7 @@ int main(int argc, char** argv) {
                     currentKey++;
 
                 ModelReset(model);
-                ModelApplyVdf(model, vdfData, currentKey, 1.f);
+                ModelApplyVdf(model, currentKey, 1.f);
                 ModelUpdate(model);
             }
             else if (canAnimate)
@@ -264,6 +346,19 @@ int main(int argc, char** argv) {
         if (IsKeyPressed(KEY_T) && canAnimate)
             playing ^= true;
 
+        // Reload the TIMs (e.g. after editing them); only what they cover gets uploaded
+        if (IsKeyPressed(KEY_R) && vrTexture && vrTexture->texture.id != 0) {
+            AllocSetForbidden(0);
+
+            VrTextureClear(vrTexture);
+            loadTims(&args, vrTexture);
+
+            u64 uploaded = VrTextureUpload(vrTexture);
+            printf("Reloaded %u TIMs (%lu KiB uploaded)\n", args.timCount, uploaded / 1024);
+
+            AllocSetForbidden(args.strictFrames);
+        }
+
         if (playing && canAnimate) {
             currentFrame += (30.f / TARGET_FPS) * animSpeed;
             if (currentFrame >= frameCount)
@@ -272,7 +367,7 @@ int main(int argc, char** argv) {
                 currentFrame = frameCount - 1;
 
             ModelReset(model);
-            ModelApplyDatVdf(model, vdfData, datData, currentFrame);
+            ModelApplyDatVdf(model, dat, currentFrame);
             ModelUpdate(model);
         }
 
@@ -330,7 +425,12 @@ int main(int argc, char** argv) {
                 DrawText(text, 0, 0, 20, BLACK);
             }
 
+            sprintf(text, "allocations : %lu (%lu B)", frameAllocs.allocations, frameAllocs.bytes);
+            DrawText(text, WINDOW_WIDTH - MeasureText(text, 20) - 5, 0, 20, BLACK);
+
 		EndDrawing();
+
+        frameAllocs = AllocGetStatsSince(frameStart);
 	}
 
     CloseWindow();
@@ -339,13 +439,18 @@ int main(int argc, char** argv) {
 
     free(args.timFiles);
 
-    ModelDestroy(model);
-    free(tmdData);
+    if (vrTexture)
+        VrTextureDestroy(vrTexture);
 
-    if (vdfData)
-        free(vdfData);
-    if (datData)
-        free(datData);
+    ModelDestroy(model);
+    BinaryUnmap(&tmdBinary);
+
+    if (vdf)
+        VdfDestroy(vdf);
+    BinaryUnmap(&vdfBinary);
+    if (dat)
+        DatDestroy(dat);
+    BinaryUnmap(&datBinary);
 
     printf("\nAll done. Exiting..\n");
 
@@ -0,0 +1,355 @@
+#ifndef MESH_OPTIMIZE_H
+#define MESH_OPTIMIZE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "allocStats.h"
+#include "common.h"
+
+// Triangle & vertex reordering of indexed triangle lists (raylib's unsigned short indices), so
+// the GPU reuses more transformed vertices and fetches them in order.
+
+// Size of the LRU cache the vertex cache optimization scores against
+#define MESH_CACHE_SIZE (32)
+// Size of the FIFO cache MeshCountCacheMisses simulates
+#define MESH_FIFO_SIZE (16)
+
+// Default for MeshOptimizeOverdraw; lets clusters get up to 5% worse than the mesh's ACMR
+#define MESH_OVERDRAW_THRESHOLD (1.05f)
+
+// Vertices transformed when drawing the triangles through a MESH_FIFO_SIZE FIFO cache; divide by
+// the triangle count for the ACMR (average cache miss ratio)
+u32 MeshCountCacheMisses(unsigned short* indices, u32 triangleCount, u32 vertexCount) {
+    // A vertex is in the cache if fewer than MESH_FIFO_SIZE misses happened since it was loaded
+    u32* loadedAt = (u32*)CountedMalloc(vertexCount * sizeof(u32));
+    for (u32 i = 0; i < vertexCount; i++)
+        loadedAt[i] = 0xFFFFFFFF;
+
+    u32 misses = 0;
+    for (u32 i = 0; i < triangleCount * 3; i++) {
+        u32 v = indices[i];
+
+        if (loadedAt[v] == 0xFFFFFFFF || misses - loadedAt[v] >= MESH_FIFO_SIZE)
+            loadedAt[v] = misses++;
+    }
+
+    CountedFree(loadedAt);
+
+    return misses;
+}
+
+float _MeshVertexScore(s32 cachePosition, u32 remaining) {
+    // Nothing left to draw with it
+    if (remaining == 0)
+        return -1.f;
+
+    float score = 0.f;
+    if (cachePosition >= 0) {
+        // The last triangle's vertices score the same, whatever order it had them in
+        if (cachePosition < 3)
+            score = .75f;
+        else
+            score = powf(1.f - (cachePosition - 3) / (float)(MESH_CACHE_SIZE - 3), 1.5f);
+    }
+
+    // Finish off vertices with few triangles left, so they don't need loading again later
+    return score + 2.f / sqrtf((float)remaining);
+}
+
+// Reorder the triangles so they reuse the vertices of recent ones (Tom Forsyth's "Linear-Speed
+// Vertex Cache Optimisation")
+void MeshOptimizeVertexCache(unsigned short* indices, u32 triangleCount, u32 vertexCount) {
+    if (triangleCount == 0)
+        return;
+
+    // Triangles of every vertex; the first remaining[v] of them are the ones not drawn yet
+    u32* offsets = (u32*)CountedCalloc(vertexCount + 1, sizeof(u32));
+    u32* remaining = (u32*)CountedCalloc(vertexCount, sizeof(u32));
+    u32* adjacency = (u32*)CountedMalloc(triangleCount * 3 * sizeof(u32));
+
+    for (u32 i = 0; i < triangleCount * 3; i++)
+        offsets[indices[i] + 1]++;
+    for (u32 v = 0; v < vertexCount; v++)
+        offsets[v + 1] += offsets[v];
+    for (u32 i = 0; i < triangleCount * 3; i++) {
+        u32 v = indices[i];
+        adjacency[offsets[v] + remaining[v]++] = i / 3;
+    }
+
+    s32* cachePositions = (s32*)CountedMalloc(vertexCount * sizeof(s32));
+    float* vertexScores = (float*)CountedMalloc(vertexCount * sizeof(float));
+    for (u32 v = 0; v < vertexCount; v++) {
+        cachePositions[v] = -1;
+        vertexScores[v] = _MeshVertexScore(-1, remaining[v]);
+    }
+
+    float* triangleScores = (float*)CountedMalloc(triangleCount * sizeof(float));
+    u8* drawn = (u8*)CountedCalloc(triangleCount, 1);
+
+    u32 best = 0;
+    for (u32 t = 0; t < triangleCount; t++) {
+        unsigned short* tri = indices + t * 3;
+        triangleScores[t] = vertexScores[tri[0]] + vertexScores[tri[1]] + vertexScores[tri[2]];
+
+        if (triangleScores[t] > triangleScores[best])
+            best = t;
+    }
+
+    unsigned short* output = (unsigned short*)CountedMalloc(triangleCount * 3 * sizeof(unsigned short));
+
+    // The new cache is built in the second half while the first one is read
+    u32 cache[(MESH_CACHE_SIZE + 3) * 2];
+    u32 cacheCount = 0;
+
+    u32 nextUndrawn = 0;
+
+    for (u32 i = 0; i < triangleCount; i++) {
+        if (best == 0xFFFFFFFF) {
+            // Nothing in the cache has triangles left; carry on from wherever is next
+            while (drawn[nextUndrawn])
+                nextUndrawn++;
+            best = nextUndrawn;
+        }
+
+        unsigned short* tri = indices + best * 3;
+        memcpy(output + i * 3, tri, 3 * sizeof(unsigned short));
+        drawn[best] = 1;
+
+        u32* newCache = cache + MESH_CACHE_SIZE + 3;
+        u32 newCacheCount = 0;
+
+        for (unsigned j = 0; j < 3; j++) {
+            u32 v = tri[j];
+
+            // Drop the triangle from the vertex's remaining ones
+            u32* list = adjacency + offsets[v];
+            for (u32 k = 0; k < remaining[v]; k++) {
+                if (list[k] == best) {
+                    list[k] = list[--remaining[v]];
+                    break;
+                }
+            }
+
+            if (cachePositions[v] != -2) {
+                newCache[newCacheCount++] = v;
+                cachePositions[v] = -2; // Marks it as already added
+            }
+        }
+        for (u32 k = 0; k < cacheCount; k++) {
+            u32 v = cache[k];
+            if (cachePositions[v] != -2)
+                newCache[newCacheCount++] = v;
+        }
+
+        // Rescore everything that was or is in the cache, and find the best triangle of those
+        // that are still in it
+        best = 0xFFFFFFFF;
+        float bestScore = -1.f;
+
+        for (u32 k = 0; k < newCacheCount; k++) {
+            u32 v = newCache[k];
+
+            cachePositions[v] = k < MESH_CACHE_SIZE ? (s32)k : -1;
+            vertexScores[v] = _MeshVertexScore(cachePositions[v], remaining[v]);
+        }
+        for (u32 k = 0; k < newCacheCount; k++) {
+            u32 v = newCache[k];
+
+            u32* list = adjacency + offsets[v];
+            for (u32 a = 0; a < remaining[v]; a++) {
+                u32 t = list[a];
+                unsigned short* other = indices + t * 3;
+
+                triangleScores[t] = vertexScores[other[0]] + vertexScores[other[1]] + vertexScores[other[2]];
+                if (k < MESH_CACHE_SIZE && triangleScores[t] > bestScore) {
+                    best = t;
+                    bestScore = triangleScores[t];
+                }
+            }
+        }
+
+        cacheCount = MIN(newCacheCount, MESH_CACHE_SIZE);
+        memmove(cache, newCache, cacheCount * sizeof(u32));
+    }
+
+    memcpy(indices, output, triangleCount * 3 * sizeof(unsigned short));
+
+    CountedFree(output);
+    CountedFree(drawn);
+    CountedFree(triangleScores);
+    CountedFree(vertexScores);
+    CountedFree(cachePositions);
+    CountedFree(adjacency);
+    CountedFree(remaining);
+    CountedFree(offsets);
+}
+
+// Reorder the vertices (vertexSize bytes each) to the order the triangles first use them in.
+// Vertices no triangle uses end up last.
+void MeshOptimizeVertexFetch(
+    unsigned short* indices, u32 triangleCount, void* vertices, u32 vertexCount, u32 vertexSize
+) {
+    u32* remap = (u32*)CountedMalloc(vertexCount * sizeof(u32));
+    for (u32 v = 0; v < vertexCount; v++)
+        remap[v] = 0xFFFFFFFF;
+
+    u32 next = 0;
+    for (u32 i = 0; i < triangleCount * 3; i++) {
+        u32 v = indices[i];
+        if (remap[v] == 0xFFFFFFFF)
+            remap[v] = next++;
+
+        indices[i] = remap[v];
+    }
+    for (u32 v = 0; v < vertexCount; v++) {
+        if (remap[v] == 0xFFFFFFFF)
+            remap[v] = next++;
+    }
+
+    u8* reordered = (u8*)CountedMalloc((u64)vertexCount * vertexSize);
+    for (u32 v = 0; v < vertexCount; v++)
+        memcpy(reordered + (u64)remap[v] * vertexSize, (u8*)vertices + (u64)v * vertexSize, vertexSize);
+    memcpy(vertices, reordered, (u64)vertexCount * vertexSize);
+
+    CountedFree(reordered);
+    CountedFree(remap);
+}
+
+typedef struct {
+    u32 first, end; // Triangles
+    float sortKey;
+} _MeshCluster;
+
+int _MeshCompareClusters(const void* a, const void* b) {
+    const _MeshCluster* clusterA = (const _MeshCluster*)a;
+    const _MeshCluster* clusterB = (const _MeshCluster*)b;
+
+    // Outward facing first; ties keep their order
+    if (clusterA->sortKey != clusterB->sortKey)
+        return clusterA->sortKey < clusterB->sortKey ? 1 : -1;
+    return (clusterA->first > clusterB->first) - (clusterA->first < clusterB->first);
+}
+
+// Reorder clusters of cache optimized triangles (run MeshOptimizeVertexCache first) so the ones
+// facing away from the mesh's center are drawn first, and likely cover the ones behind them
+// (Sander et al., "Fast Triangle Reordering for Vertex Locality and Reduced Overdraw").
+// Triangles are split into more, smaller clusters as long as the ACMR stays within threshold
+// times the original. positions holds xyz per vertex; triangles are front facing when
+// counter-clockwise.
+void MeshOptimizeOverdraw(
+    unsigned short* indices, u32 triangleCount, float* positions, u32 vertexCount, float threshold
+) {
+    if (triangleCount == 0)
+        return;
+
+    _MeshCluster* clusters = (_MeshCluster*)CountedMalloc(triangleCount * sizeof(_MeshCluster));
+    u32 clusterCount = 0;
+
+    // Hard boundaries: the cache is already cold where a triangle misses on every vertex, so
+    // cutting there costs nothing. Soft ones within those are cut whenever the cluster so far is
+    // cache efficient enough.
+    {
+        float targetAcmr = threshold * MeshCountCacheMisses(indices, triangleCount, vertexCount) / (float)triangleCount;
+
+        u32* loadedAt = (u32*)CountedMalloc(vertexCount * sizeof(u32));
+        for (u32 v = 0; v < vertexCount; v++)
+            loadedAt[v] = 0xFFFFFFFF;
+
+        u32 misses = 0;
+        u32 clusterStart = 0, clusterMisses = 0;
+        for (u32 t = 0; t < triangleCount; t++) {
+            u32 triangleMisses = 0;
+            for (unsigned j = 0; j < 3; j++) {
+                u32 v = indices[t * 3 + j];
+                if (loadedAt[v] == 0xFFFFFFFF || misses - loadedAt[v] >= MESH_FIFO_SIZE) {
+                    loadedAt[v] = misses++;
+                    triangleMisses++;
+                }
+            }
+
+            if (triangleMisses == 3 && t > clusterStart) {
+                clusters[clusterCount++] = (_MeshCluster){ clusterStart, t, 0.f };
+                clusterStart = t;
+                clusterMisses = 0;
+            }
+            clusterMisses += triangleMisses;
+
+            if (clusterMisses <= targetAcmr * (t + 1 - clusterStart)) {
+                clusters[clusterCount++] = (_MeshCluster){ clusterStart, t + 1, 0.f };
+                clusterStart = t + 1;
+                clusterMisses = 0;
+
+                // The next cluster may be drawn after any other one, so it starts cold
+                misses += MESH_FIFO_SIZE;
+            }
+        }
+        if (clusterStart < triangleCount)
+            clusters[clusterCount++] = (_MeshCluster){ clusterStart, triangleCount, 0.f };
+
+        CountedFree(loadedAt);
+    }
+
+    float meshCenter[3] = { 0.f, 0.f, 0.f };
+    for (u32 v = 0; v < vertexCount; v++) {
+        for (unsigned k = 0; k < 3; k++)
+            meshCenter[k] += positions[v * 3 + k] / vertexCount;
+    }
+
+    for (u32 c = 0; c < clusterCount; c++) {
+        _MeshCluster* cluster = clusters + c;
+
+        // Area weighted; the cross products are twice the triangle areas
+        float center[3] = { 0.f, 0.f, 0.f };
+        float normal[3] = { 0.f, 0.f, 0.f };
+        float area = 0.f;
+
+        for (u32 t = cluster->first; t < cluster->end; t++) {
+            float* a = positions + indices[t * 3 + 0] * 3;
+            float* b = positions + indices[t * 3 + 1] * 3;
+            float* p = positions + indices[t * 3 + 2] * 3;
+
+            float ab[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+            float ap[3] = { p[0] - a[0], p[1] - a[1], p[2] - a[2] };
+            float cross[3] = {
+                ab[1] * ap[2] - ab[2] * ap[1],
+                ab[2] * ap[0] - ab[0] * ap[2],
+                ab[0] * ap[1] - ab[1] * ap[0]
+            };
+            float triangleArea = sqrtf(cross[0] * cross[0] + cross[1] * cross[1] + cross[2] * cross[2]);
+
+            for (unsigned k = 0; k < 3; k++) {
+                center[k] += (a[k] + b[k] + p[k]) / 3.f * triangleArea;
+                normal[k] += cross[k];
+            }
+            area += triangleArea;
+        }
+
+        float normalLength = sqrtf(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+        if (area == 0.f || normalLength == 0.f)
+            continue; // Only lines (or degenerate triangles) don't matter to overdraw
+
+        float sortKey = 0.f;
+        for (unsigned k = 0; k < 3; k++)
+            sortKey += (center[k] / area - meshCenter[k]) * normal[k];
+        cluster->sortKey = sortKey / normalLength;
+    }
+
+    qsort(clusters, clusterCount, sizeof(_MeshCluster), _MeshCompareClusters);
+
+    unsigned short* output = (unsigned short*)CountedMalloc(triangleCount * 3 * sizeof(unsigned short));
+
+    u32 outputCount = 0;
+    for (u32 c = 0; c < clusterCount; c++) {
+        u32 count = (clusters[c].end - clusters[c].first) * 3;
+        memcpy(output + outputCount, indices + clusters[c].first * 3, count * sizeof(unsigned short));
+        outputCount += count;
+    }
+    memcpy(indices, output, triangleCount * 3 * sizeof(unsigned short));
+
+    CountedFree(output);
+    CountedFree(clusters);
+}
+
+#endif
@@ -2,13 +2,20 @@
 #define MODEL_H
 
 #include "tmdProcess.h"
+#include "texCache.h"
+#include "meshOptimize.h"
 
 #include "vdfProcess.h"
 #include "datProcess.h"
+#include "arena.h"
+
+#include <stddef.h>
 
 #include <raylib.h>
 #include <raymath.h>
+#include <rlgl.h>
 
+#include "allocStats.h"
 #include "common.h"
 
 #define MODEL_SCALE (.02f)
@@ -26,13 +33,220 @@ const char MAT_SHADER[] =
 "    finalColor = texelColor;\n"
 "}";
 
+// Native VRAM mode: the texture is the PSX VRAM itself (VR_WIDTH x VR_HEIGHT 16-bit words,
+// uploaded as R5G5B5A1 so every word can be rebuilt exactly) and the texel fetch + CLUT lookup
+// happen here. vertexTexCoord is the same 4-bit VRAM column as in the RGBA mode; vertexTexCoord2
+// carries the primitive's (tsb, cba), or a negative tsb for untextured primitives.
+const char VRAM_VERTEX_SHADER[] =
+"#version 330\n"
+"in vec3 vertexPosition;\n"
+"in vec2 vertexTexCoord;\n"
+"in vec2 vertexTexCoord2;\n"
+"in vec4 vertexColor;\n"
+"uniform mat4 mvp;\n"
+"out vec2 fragTexCoord;\n"
+"flat out ivec2 fragTexInfo;\n"
+"out vec4 fragColor;\n"
+"void main() {\n"
+"    fragTexCoord = vertexTexCoord;\n"
+"    fragTexInfo = ivec2(vertexTexCoord2);\n"
+"    fragColor = vertexColor;\n"
+"    gl_Position = mvp * vec4(vertexPosition, 1.0);\n"
+"}";
+
+const char VRAM_SHADER[] =
+"#version 330\n"
+"in vec2 fragTexCoord;\n"
+"flat in ivec2 fragTexInfo;\n"
+"in vec4 fragColor;\n"
+"uniform sampler2D texture0;\n"
+"uniform vec4 colDiffuse;\n"
+"out vec4 finalColor;\n"
+"int vramFetch(ivec2 p) {\n"
+"    vec4 c = texelFetch(texture0, p & ivec2(1023, 511), 0);\n"
+"    ivec4 b = ivec4(round(c * vec4(31.0, 31.0, 31.0, 1.0)));\n"
+"    return (b.r << 11) | (b.g << 6) | (b.b << 1) | b.a;\n"
+"}\n"
+"void main() {\n"
+"    if (fragTexInfo.x < 0) {\n"
+"        finalColor = fragColor * colDiffuse;\n"
+"        return;\n"
+"    }\n"
+"    int tpf = (fragTexInfo.x >> 7) & 3;\n"
+"    ivec2 clut = ivec2((fragTexInfo.y & 0x3F) * 16, (fragTexInfo.y >> 6) & 0x1FF);\n"
+"    ivec2 column = ivec2(floor(fragTexCoord * vec2(4096.0, 512.0)));\n"
+"    int word = vramFetch(ivec2(column.x >> 2, column.y));\n"
+"    int color;\n"
+"    if (tpf == 0)\n"
+"        color = vramFetch(clut + ivec2((word >> ((column.x & 3) * 4)) & 0xF, 0));\n"
+"    else if (tpf == 1)\n"
+"        color = vramFetch(clut + ivec2((word >> (((column.x >> 1) & 1) * 8)) & 0xFF, 0));\n"
+"    else\n"
+"        color = word;\n"
+"    if (color == 0) discard;\n"
+"    vec3 rgb = vec3(color & 31, (color >> 5) & 31, (color >> 10) & 31) / 31.0;\n"
+"    finalColor = vec4(rgb, 1.0) * colDiffuse;\n"
+"}";
+
+// Vertex shader for compact packs (see ModelPackCompactAttributes), which works with MAT_SHADER,
+// VRAM_SHADER and raylib's default fragment shader. Positions and the (tsb, cba) come in as the
+// integers they are stored as, texcoords in 1/65536ths.
+const char COMPACT_VERTEX_SHADER[] =
+"#version 330\n"
+"in vec3 vertexPosition;\n"
+"in vec2 vertexTexCoord;\n"
+"in vec2 vertexTexCoord2;\n"
+"in vec4 vertexColor;\n"
+"uniform mat4 mvp;\n"
+"out vec2 fragTexCoord;\n"
+"flat out ivec2 fragTexInfo;\n"
+"out vec4 fragColor;\n"
+"void main() {\n"
+"    fragTexCoord = vertexTexCoord / 65536.0;\n"
+"    fragTexInfo = vertexTexCoord2.x == 65535.0 ? ivec2(-1, 0) : ivec2(vertexTexCoord2);\n"
+"    fragColor = vertexColor;\n"
+"    gl_Position = mvp * vec4(vertexPosition, 1.0);\n"
+"}";
+
+// Vertex attribute types rlgl has no names for
+#define MODEL_GL_SHORT (0x1402)
+#define MODEL_GL_UNSIGNED_SHORT (0x1403)
+#define MODEL_GL_INT_2_10_10_10_REV (0x8D9F)
+
+// Mesh indices are unsigned short
+#define MODEL_MAX_MESH_VERTICES (65536)
+
+// Everything a mesh vertex is made of; primitive corners with identical ones are welded
+typedef struct __attribute__((packed)) {
+    u32 source; // Index into the object's vertex table; positions come from there (and VDF)
+    float normal[3];
+    float texcoord[2];
+    float texInfo[2]; // texcoords2
+    u8 color[4];
+} ModelVertex;
+
+// Maps every vertex of a TMD object's vertex table to the vertices of one of the object's meshes
+// welded from it. They are slots[offsets[i]] .. slots[offsets[i + 1] - 1] for TMD vertex i.
+typedef struct {
+    u32* offsets;
+    u32* slots;
+} ModelVertexRemap;
+
+// Interleaved attributes of a ModelPack vertex, the same as the meshes'. Positions, the only
+// attribute that changes, are a separate float[3] stream.
+typedef struct __attribute__((packed)) {
+    float normal[3];
+    float texcoord[2];
+    float texcoord2[2];
+    u8 color[4];
+} ModelPackAttributes;
+
+// Quantized ModelPackAttributes: normals signed normalized 10:10:10:2, texcoords in 1/65536ths
+// wrapped to [0, 1) (so VRAM columns & rows, and atlas pixels, stay exact) and texcoord2 the
+// (tsb, cba) with a tsb of 0xFFFF for untextured vertices. Positions are an s16[4] stream in the
+// TMD's own units (VDF morphs get rounded to them), so a vertex takes 24 bytes instead of 44.
+typedef struct __attribute__((packed)) {
+    u32 normal;
+    u16 texcoord[2];
+    u16 texcoord2[2];
+    u8 color[4];
+} ModelPackCompactAttributes;
+
+typedef enum {
+    MODEL_PACK_FLOAT, // ModelPackAttributes
+    MODEL_PACK_COMPACT // ModelPackCompactAttributes; textures get COMPACT_VERTEX_SHADER
+} ModelPackFormat;
+
+// Meshes packed into shared buffers, drawn with one call. The attributes that never change are
+// interleaved in one static buffer. Positions have two dynamic buffers, one VAO each, so an update
+// never writes the buffer the GPU may still be drawing from.
+typedef struct {
+    u32 vaoIds[2], positionVboIds[2];
+    u32 attributeVboId, iboId;
+    u32 current; // Position buffer that is drawn; the other one gets the next update
+
+    // CPU copies, for updates; one allocation
+    u8* positions;
+    u8* attributes;
+
+    u32 vertexCount;
+    u32 indexCount;
+
+    u32 firstMesh, endMesh;
+} ModelPack;
+
+// Where a mesh's vertices & indices are in its pack
+typedef struct {
+    u32 pack;
+    u32 firstVertex, firstIndex;
+} ModelPackRange;
+
+// Range [first, end) of vertices (of a TMD object's vertex table or of a mesh); empty if
+// first >= end
 typedef struct {
-    u8* _tmdDataOriginal; // Original TMD data
-    u32 _tmdDataSize; // Size of orignal TMD data
-    u8* _tmdData; // Mutable copy of original TMD data
+    u32 first, end;
+} ModelVertexRange;
+
+#define MODEL_MAX_DIRTY_SPANS (16)
+// Dirty vertices closer than this to a span are merged into it; re-uploading a few clean
+// vertices is cheaper than issuing another buffer update
+#define MODEL_DIRTY_SPAN_GAP (32)
+
+// Mesh vertices whose positions changed since the last upload
+typedef struct {
+    u32 count;
+    ModelVertexRange spans[MODEL_MAX_DIRTY_SPANS];
+} ModelDirtySpans;
+
+typedef struct {
+    // Holds the model and everything it allocates that lives as long as it, freed at once by
+    // ModelDestroy. Arrays that grow while building stay on the heap.
+    Arena* _arena;
+    // Transient buffers of one step (an object being built, an upload ...); whatever uses it
+    // resets it first
+    Arena* _scratch;
+
+    u8* _tmdData; // Read-only TMD data (not owned, must outlive the model)
+    u64 _tmdDataSize; // Size of TMD data
+
+    VdfData* _vdf; // Attached with ModelAttachVdf (not owned)
+    float* _keyInfluences; // Per VDF key, scratch for ModelApplyDatVdf
+
+    // Per object; float copies of the part of the vertex table that VDF keys touch (the only part
+    // of the TMD that VDF mutates), as originally loaded and with VDF keys blended in. Objects no
+    // key touches have empty windows. All of them live in _positionData.
+    VdfPositions* _basePositions;
+    VdfPositions* _workPositions;
+    float* _positionData;
+
+    // Meshes [_objectMeshes[i], _objectMeshes[i + 1]) were built from object i; objects are
+    // only split when they have too many vertices for one mesh
+    u32* _objectMeshes;
+
+    ModelVertexRemap* _vertexRemaps; // Per mesh
+
+    // Per object; vertices changed by VDF since the last reset (restored by the next reset), and
+    // vertices whose mesh positions are out of date (scattered by the next ModelUpdate)
+    ModelVertexRange* _morphedRanges;
+    ModelVertexRange* _dirtyRanges;
+
+    ModelDirtySpans* _dirtySpans; // Per mesh
+    // Per mesh of a pack; positions updated in the pack's current buffer but not the other yet
+    ModelDirtySpans* _staleSpans;
+
+    // Set by ModelUploadPacked, which uploads these instead of the meshes
+    ModelPack* _packs;
+    u32 _packCount;
+    ModelPackFormat _packFormat;
+    ModelPackRange* _packRanges; // Per mesh
+
+    u32 _tmdOrderCacheMisses; // Of all meshes, before MeshOptimizeVertexCache
 
     Model* rModel;
 
+    // ACMR of the meshes with their triangles in TMD primitive order; compare with ModelGetAcmr
+    float tmdOrderAcmr;
+
     Vector3 position;
 
     Vector3 rotationAxis;
@@ -43,185 +257,414 @@ typedef struct {
     Color tint;
 } ModelData;
 
-void _ModelFillMesh(ModelData* model, unsigned objectIndex) {
-    u32 primitiveCount = TmdObjectGetPrimitiveCount(model->_tmdData, objectIndex);
-    WorkPrimitive* primitives = TmdObjectCreateWorkPrimitives(model->_tmdData, objectIndex);
-
-    Mesh* mesh = model->rModel->meshes + objectIndex;
+void _ModelVertexRangeAdd(ModelVertexRange* range, u32 first, u32 end) {
+    if (first >= end)
+        return;
 
-    unsigned vertexOffset = 0;
-    unsigned indexOffset = 0;
+    if (range->first >= range->end) {
+        range->first = first;
+        range->end = end;
+    }
+    else {
+        range->first = MIN(range->first, first);
+        range->end = MAX(range->end, end);
+    }
+}
 
-    for (unsigned i = 0; i < primitiveCount; i++) {
-        WorkPrimitive* prim = primitives + i;
+// Undo the VDF keys applied since the last reset by restoring only the vertices they changed.
+// ModelUpdate must be called before changes are reflected
+void ModelReset(ModelData* model) {
+    if (model->_vdf == NULL)
+        return;
 
-        if (!prim->flags.OK)
+    u32 objectCount = TmdGetObjectCount(model->_tmdData);
+    for (unsigned i = 0; i < objectCount; i++) {
+        ModelVertexRange* morphed = model->_morphedRanges + i;
+        if (morphed->first >= morphed->end)
             continue;
 
-        if (prim->flags.isLine) {
-            // Line case: Use only v1 and v2
-
-            for (unsigned j = 0; j < 2; j++) { // Process only two vertices (v1, v2)
-                unsigned vertexIndex = (vertexOffset + j) * 3;
-                mesh->vertices[vertexIndex + 0] = (float)prim->vertices[j][0]; // X
-                mesh->vertices[vertexIndex + 1] = (float)prim->vertices[j][1]; // Y
-                mesh->vertices[vertexIndex + 2] = (float)prim->vertices[j][2]; // Z
-
-                // Fill normals
-                mesh->normals[vertexIndex + 0] = (float)prim->normals[j][0]; // Normal X
-                mesh->normals[vertexIndex + 1] = (float)prim->normals[j][1]; // Normal Y
-                mesh->normals[vertexIndex + 2] = (float)prim->normals[j][2]; // Normal Z
-
-                // Fill color based on vertex
-                unsigned colorIndex = (vertexOffset + j) * 4;
-                if (j == 0) {
-                    mesh->colors[colorIndex + 0] = prim->rgb0[0];
-                    mesh->colors[colorIndex + 1] = prim->rgb0[1];
-                    mesh->colors[colorIndex + 2] = prim->rgb0[2];
-                    mesh->colors[colorIndex + 3] = 255; // Alpha
-                } else {
-                    mesh->colors[colorIndex + 0] = prim->rgb1[0];
-                    mesh->colors[colorIndex + 1] = prim->rgb1[1];
-                    mesh->colors[colorIndex + 2] = prim->rgb1[2];
-                    mesh->colors[colorIndex + 3] = 255; // Alpha
-                }
-            }
+        VdfPositions* base = model->_basePositions + i;
+        VdfPositions* work = model->_workPositions + i;
+
+        u32 offset = morphed->first - base->first;
+        u32 size = (morphed->end - morphed->first) * sizeof(float);
+        memcpy(work->x + offset, base->x + offset, size);
+        memcpy(work->y + offset, base->y + offset, size);
+        memcpy(work->z + offset, base->z + offset, size);
+
+        // Restored vertices have to be scattered back into the mesh
+        _ModelVertexRangeAdd(model->_dirtyRanges + i, morphed->first, morphed->end);
+        *morphed = (ModelVertexRange){ 0 };
+    }
+}
+
+// Record that VDF changed the vertices [first, end) of an object
+void _ModelMarkMorphed(ModelData* model, u32 objectIndex, u32 first, u32 end) {
+    if (objectIndex >= TmdGetObjectCount(model->_tmdData))
+        panic("VDF key targets a nonexistent object");
+    if (end > TmdObjectGetVertexCount(model->_tmdData, objectIndex))
+        panic("VDF key is out of bounds of the object's vertex table");
+
+    _ModelVertexRangeAdd(model->_morphedRanges + objectIndex, first, end);
+    _ModelVertexRangeAdd(model->_dirtyRanges + objectIndex, first, end);
+}
 
-            // Fill indices for the line (2 indices)
-            mesh->indices[indexOffset + 0] = vertexOffset + 0; // v1
-            mesh->indices[indexOffset + 1] = vertexOffset + 1; // v2
+// Build the TMD vertex -> mesh vertex remap of a mesh from the sources of its welded vertices
+void _ModelBuildVertexRemap(
+    ModelData* model, ModelVertexRemap* remap, u32 tmdVertexCount, ModelVertex* vertices, u32 vertexCount
+) {
+    remap->offsets = (u32*)ArenaCalloc(model->_arena, tmdVertexCount + 1, sizeof(u32));
+    remap->slots = (u32*)ArenaAlloc(model->_arena, vertexCount * sizeof(u32));
 
-            vertexOffset += 2;
-            indexOffset += 2;
+    for (u32 i = 0; i < vertexCount; i++)
+        remap->offsets[vertices[i].source + 1]++;
+    for (u32 i = 0; i < tmdVertexCount; i++)
+        remap->offsets[i + 1] += remap->offsets[i];
 
+    u32* cursors = (u32*)ArenaAlloc(model->_scratch, tmdVertexCount * sizeof(u32));
+    memcpy(cursors, remap->offsets, tmdVertexCount * sizeof(u32));
+
+    for (u32 i = 0; i < vertexCount; i++)
+        remap->slots[cursors[vertices[i].source]++] = i;
+}
+
+// Add mesh vertices [first, end)
+void _ModelDirtySpansAdd(ModelDirtySpans* dirty, u32 first, u32 end) {
+    // Most scatters are local, so check the last touched span first
+    for (u32 i = dirty->count; i-- > 0;) {
+        ModelVertexRange* span = dirty->spans + i;
+
+        if (end + MODEL_DIRTY_SPAN_GAP >= span->first && first <= span->end + MODEL_DIRTY_SPAN_GAP) {
+            span->first = MIN(span->first, first);
+            span->end = MAX(span->end, end);
+
+            return;
         }
-        else {
-            // Triangle case: Use all 3 vertices (v1, v2, v3)
-
-            for (unsigned j = 0; j < 3; j++) {
-                unsigned vertexIndex = (vertexOffset + j) * 3;
-                mesh->vertices[vertexIndex + 0] = (float)(prim->vertices[j][0]); // X
-                mesh->vertices[vertexIndex + 1] = (float)(prim->vertices[j][1]); // Y
-                mesh->vertices[vertexIndex + 2] = (float)(prim->vertices[j][2]); // Z
-
-                // Fill normals
-                mesh->normals[vertexIndex + 0] = prim->normals[j][0]; // Normal X
-                mesh->normals[vertexIndex + 1] = prim->normals[j][1]; // Normal Y
-                mesh->normals[vertexIndex + 2] = prim->normals[j][2]; // Normal Z
-
-                // Fill color based on vertex
-                unsigned colorIndex = (vertexOffset + j) * 4;
-                if (!prim->flags.isTextured)
-                    switch (j) {
-                        case 0:
-                            mesh->colors[colorIndex + 0] = prim->rgb0[0];
-                            mesh->colors[colorIndex + 1] = prim->rgb0[1];
-                            mesh->colors[colorIndex + 2] = prim->rgb0[2];
-                            mesh->colors[colorIndex + 3] = 255; // Alpha
-                            break;
-                        case 1:
-                            mesh->colors[colorIndex + 0] = prim->rgb1[0];
-                            mesh->colors[colorIndex + 1] = prim->rgb1[1];
-                            mesh->colors[colorIndex + 2] = prim->rgb1[2];
-                            mesh->colors[colorIndex + 3] = 255; // Alpha
-                            break;
-                        case 2:
-                            mesh->colors[colorIndex + 0] = prim->rgb2[0];
-                            mesh->colors[colorIndex + 1] = prim->rgb2[1];
-                            mesh->colors[colorIndex + 2] = prim->rgb2[2];
-                            mesh->colors[colorIndex + 3] = 255; // Alpha
-                            break;
-                    }
-                else {
-                    mesh->colors[colorIndex + 0] = 255;
-                    mesh->colors[colorIndex + 1] = 255;
-                    mesh->colors[colorIndex + 2] = 255;
-                    mesh->colors[colorIndex + 3] = 255;
-                }
-
-                if (prim->flags.isTextured) {
-                    unsigned coordIndex = (vertexOffset + j) * 2;
-                    switch (j) {
-                        case 0:
-                            mesh->texcoords[coordIndex + 0] = prim->uv0[0] / (float)VR_WIDTH32;
-                            mesh->texcoords[coordIndex + 1] = prim->uv0[1] / (float)VR_HEIGHT;
-                            break;
-                        case 1:
-                            mesh->texcoords[coordIndex + 0] = prim->uv1[0] / (float)VR_WIDTH32;
-                            mesh->texcoords[coordIndex + 1] = prim->uv1[1] / (float)VR_HEIGHT;
-                            break;
-                        case 2:
-                            mesh->texcoords[coordIndex + 0] = prim->uv2[0] / (float)VR_WIDTH32;
-                            mesh->texcoords[coordIndex + 1] = prim->uv2[1] / (float)VR_HEIGHT;
-                            break;
-                    }
-                }
-            }
+    }
+
+    if (dirty->count < MODEL_MAX_DIRTY_SPANS) {
+        dirty->spans[dirty->count++] = (ModelVertexRange){ first, end };
+        return;
+    }
+
+    // Out of spans; grow whichever one is closest
+    u32 closest = 0;
+    u32 closestDistance = 0xFFFFFFFF;
+    for (u32 i = 0; i < dirty->count; i++) {
+        ModelVertexRange* span = dirty->spans + i;
+
+        u32 distance = end < span->first ? span->first - end : first - span->end;
+        if (distance < closestDistance) {
+            closest = i;
+            closestDistance = distance;
+        }
+    }
+
+    ModelVertexRange* span = dirty->spans + closest;
+    span->first = MIN(span->first, first);
+    span->end = MAX(span->end, end);
+}
+
+int _ModelCompareSpans(const void* a, const void* b) {
+    u32 firstA = ((ModelVertexRange*)a)->first;
+    u32 firstB = ((ModelVertexRange*)b)->first;
+
+    return (firstA > firstB) - (firstA < firstB);
+}
+
+// Sort the spans and merge the ones that overlap or are within MODEL_DIRTY_SPAN_GAP
+void _ModelDirtySpansMerge(ModelDirtySpans* dirty) {
+    if (dirty->count < 2)
+        return;
+
+    qsort(dirty->spans, dirty->count, sizeof(ModelVertexRange), _ModelCompareSpans);
+
+    u32 merged = 0;
+    for (u32 i = 1; i < dirty->count; i++) {
+        ModelVertexRange* last = dirty->spans + merged;
+        ModelVertexRange* span = dirty->spans + i;
+
+        if (span->first <= last->end + MODEL_DIRTY_SPAN_GAP)
+            last->end = MAX(last->end, span->end);
+        else
+            dirty->spans[++merged] = *span;
+    }
+
+    dirty->count = merged + 1;
+}
+
+// Copy the work positions of vertex table range [first, end) of an object into every vertex of
+// one of its meshes using them
+void _ModelScatterPositions(ModelData* model, unsigned objectIndex, unsigned meshIndex, u32 first, u32 end) {
+    VdfPositions* work = model->_workPositions + objectIndex;
+    ModelVertexRemap* remap = model->_vertexRemaps + meshIndex;
+    ModelDirtySpans* dirty = model->_dirtySpans + meshIndex;
+
+    float* meshVertices = model->rModel->meshes[meshIndex].vertices;
+
+    for (u32 v = first; v < end; v++) {
+        u32 w = v - work->first;
+        float x = work->x[w], y = work->y[w], z = work->z[w];
+
+        for (u32 s = remap->offsets[v]; s < remap->offsets[v + 1]; s++) {
+            u32 slot = remap->slots[s];
+
+            float* position = meshVertices + slot * 3;
+            position[0] = x;
+            position[1] = y;
+            position[2] = z;
+
+            _ModelDirtySpansAdd(dirty, slot, slot + 1);
+        }
+    }
+}
+
+// FNV-1a over the whole vertex
+u32 _ModelHashVertex(ModelVertex* vertex) {
+    u8* bytes = (u8*)vertex;
+
+    u32 hash = 2166136261u;
+    for (unsigned i = 0; i < sizeof(ModelVertex); i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+// normals is the object's normal table converted to floats
+ModelVertex _ModelGetCornerVertex(
+    WorkPrimitives* primitives, u32 primitiveIndex, unsigned corner, WorkNormal* normals
+) {
+    u8 attribs = primitives->attribs[primitiveIndex];
+
+    ModelVertex vertex;
+    memset(&vertex, 0, sizeof(ModelVertex));
+
+    vertex.source = primitives->vertexIndexes[primitiveIndex][corner];
+
+    if (!(attribs & TMD_PRIM_ATTRIB_NONLIT)) {
+        WorkNormal* normal = normals + primitives->normalIndexes[primitiveIndex][corner];
+        vertex.normal[0] = normal->x;
+        vertex.normal[1] = normal->y;
+        vertex.normal[2] = normal->z;
+    }
+
+    if (attribs & TMD_PRIM_ATTRIB_TEXTURED) {
+        memset(vertex.color, 255, sizeof(vertex.color));
+
+        u16* uv = primitives->uvs[primitiveIndex][corner];
+        vertex.texcoord[0] = uv[0] / (float)VR_WIDTH32;
+        vertex.texcoord[1] = uv[1] / (float)VR_HEIGHT;
+
+        vertex.texInfo[0] = primitives->tsbs[primitiveIndex];
+        vertex.texInfo[1] = primitives->cbas[primitiveIndex];
+    }
+    else {
+        memcpy(vertex.color, primitives->colors[primitiveIndex][corner], 3);
+        vertex.color[3] = 255;
+
+        vertex.texInfo[0] = -1.f;
+    }
+
+    return vertex;
+}
+
+// Add a mesh of an object made of welded vertices; indices are into vertices. Both get reordered.
+void _ModelAddMesh(
+    ModelData* model, unsigned objectIndex, u32* meshCapacity,
+    ModelVertex* vertices, u32 vertexCount, u32* indices, u32 indexCount
+) {
+    Model* rModel = model->rModel;
+
+    if (rModel->meshCount == *meshCapacity) {
+        *meshCapacity *= 2;
+        rModel->meshes = (Mesh*)CountedRealloc(rModel->meshes, *meshCapacity * sizeof(Mesh));
+        model->_vertexRemaps = (ModelVertexRemap*)CountedRealloc(model->_vertexRemaps, *meshCapacity * sizeof(ModelVertexRemap));
+    }
+
+    Mesh* mesh = rModel->meshes + rModel->meshCount;
+    *mesh = (Mesh){ 0 };
+
+    // All arrays share one allocation; the floats go first so everything stays aligned
+    u8* block = (u8*)ArenaAlloc(
+        model->_arena, vertexCount * (10 * sizeof(float) + 4) + indexCount * sizeof(unsigned short)
+    );
+
+    mesh->vertices = (float*)block;
+    mesh->normals = mesh->vertices + vertexCount * 3;
+    mesh->texcoords = mesh->normals + vertexCount * 3;
+    // (tsb, cba) per vertex for the native VRAM shader
+    mesh->texcoords2 = mesh->texcoords + vertexCount * 2;
+    mesh->colors = (u8*)(mesh->texcoords2 + vertexCount * 2);
+    mesh->indices = (unsigned short*)(mesh->colors + vertexCount * 4);
+
+    for (u32 i = 0; i < indexCount; i++)
+        mesh->indices[i] = indices[i];
+
+    // Reorder the triangles for the vertex cache, then the vertices to match
+    model->_tmdOrderCacheMisses += MeshCountCacheMisses(mesh->indices, indexCount / 3, vertexCount);
+    MeshOptimizeVertexCache(mesh->indices, indexCount / 3, vertexCount);
+    MeshOptimizeVertexFetch(mesh->indices, indexCount / 3, vertices, vertexCount, sizeof(ModelVertex));
+
+    TmdVertex* tmdVertices = TmdObjectGetVertices(model->_tmdData, objectIndex);
+
+    for (u32 i = 0; i < vertexCount; i++) {
+        ModelVertex* vertex = vertices + i;
+        TmdVertex* tmdVertex = tmdVertices + vertex->source;
+
+        mesh->vertices[i * 3 + 0] = tmdVertex->x;
+        mesh->vertices[i * 3 + 1] = tmdVertex->y;
+        mesh->vertices[i * 3 + 2] = tmdVertex->z;
+
+        memcpy(mesh->normals + i * 3, vertex->normal, sizeof(vertex->normal));
+        memcpy(mesh->colors + i * 4, vertex->color, sizeof(vertex->color));
+        memcpy(mesh->texcoords + i * 2, vertex->texcoord, sizeof(vertex->texcoord));
+        memcpy(mesh->texcoords2 + i * 2, vertex->texInfo, sizeof(vertex->texInfo));
+    }
+
+    mesh->vertexCount = vertexCount;
+    mesh->triangleCount = indexCount / 3;
+
+    _ModelBuildVertexRemap(
+        model, model->_vertexRemaps + rModel->meshCount,
+        TmdObjectGetVertexCount(model->_tmdData, objectIndex), vertices, vertexCount
+    );
+
+    rModel->meshCount++;
+}
+
+// Weld the corners of an object's primitives into indexed meshes. Corners that share a vertex
+// table entry and all attributes become one vertex; an object with more vertices than one mesh
+// can index is split into several meshes. Objects without valid primitives get no mesh.
+void _ModelFillMeshes(ModelData* model, unsigned objectIndex, u32* meshCapacity) {
+    ArenaReset(model->_scratch);
+
+    TmdObjectCounts counts = TmdObjectGetCounts(model->_tmdData, objectIndex);
+    WorkPrimitives primitives = WorkPrimitivesInit(
+        ArenaAlloc(model->_scratch, WorkPrimitivesGetSize(counts.workPrimitiveCount)), counts.workPrimitiveCount
+    );
+    u32 primitiveCount = TmdObjectDecodeWorkPrimitives(model->_tmdData, objectIndex, &primitives);
+
+    // Converted once here rather than for every corner that references them
+    u32 normalCount = TmdObjectGetNormalCount(model->_tmdData, objectIndex);
+    TmdNormal* tmdNormals = TmdObjectGetNormals(model->_tmdData, objectIndex);
+    WorkNormal* normals = (WorkNormal*)ArenaAlloc(model->_scratch, normalCount * sizeof(WorkNormal));
+    for (unsigned i = 0; i < normalCount; i++)
+        normals[i] = TmdNormalToWorkNormal(tmdNormals + i);
+
+    u32 maxVertexCount = MIN(primitiveCount * 3, MODEL_MAX_MESH_VERTICES);
+
+    ModelVertex* vertices = (ModelVertex*)ArenaAlloc(model->_scratch, maxVertexCount * sizeof(ModelVertex));
+    u32* indices = (u32*)ArenaAlloc(model->_scratch, primitiveCount * 3 * sizeof(u32));
+
+    // Open addressing, kept at most half full; holds vertex index + 1, 0 when empty
+    u32 tableSize = 1;
+    while (tableSize < maxVertexCount * 2)
+        tableSize <<= 1;
+    u32* table = (u32*)ArenaCalloc(model->_scratch, tableSize, sizeof(u32));
+
+    u32 vertexCount = 0;
+    u32 indexCount = 0;
+
+    for (unsigned i = 0; i < primitiveCount; i++) {
+        int isLine = !!(primitives.attribs[i] & TMD_PRIM_ATTRIB_LINE);
 
-            // Fill indices for the triangle (3 indices)
-            mesh->indices[indexOffset + 0] = vertexOffset + 0; // v1
-            mesh->indices[indexOffset + 1] = vertexOffset + 1; // v2
-            mesh->indices[indexOffset + 2] = vertexOffset + 2; // v3
+        // A primitive adds at most 3 vertices; move on to a new mesh if they might not fit
+        if (vertexCount + 3 > MODEL_MAX_MESH_VERTICES) {
+            _ModelAddMesh(model, objectIndex, meshCapacity, vertices, vertexCount, indices, indexCount);
 
-            vertexOffset += 3;
-            indexOffset += 3;
+            vertexCount = indexCount = 0;
+            memset(table, 0, tableSize * sizeof(u32));
         }
+
+        u32 cornerIndices[3];
+
+        unsigned cornerCount = isLine ? 2 : 3;
+        for (unsigned j = 0; j < cornerCount; j++) {
+            ModelVertex vertex = _ModelGetCornerVertex(&primitives, i, j, normals);
+
+            u32 h = _ModelHashVertex(&vertex) & (tableSize - 1);
+            while (table[h] && memcmp(vertices + table[h] - 1, &vertex, sizeof(ModelVertex)) != 0)
+                h = (h + 1) & (tableSize - 1);
+
+            if (table[h] == 0) {
+                vertices[vertexCount] = vertex;
+                table[h] = ++vertexCount;
+            }
+
+            cornerIndices[j] = table[h] - 1;
+        }
+
+        // Lines are degenerate triangles, so the index buffer stays triangles
+        if (isLine)
+            cornerIndices[2] = cornerIndices[1];
+
+        memcpy(indices + indexCount, cornerIndices, sizeof(cornerIndices));
+        indexCount += 3;
     }
+
+    if (indexCount != 0)
+        _ModelAddMesh(model, objectIndex, meshCapacity, vertices, vertexCount, indices, indexCount);
 }
 
-ModelData* ModelCreate(u8* tmdData, u32 tmdDataSize) {
-    ModelData* model = (ModelData*)malloc(sizeof(ModelData));
+// Build the model's meshes on the CPU only; nothing touches the GPU (or needs raylib to be
+// initialized) until ModelUpload, so this is safe to run on worker threads
+ModelData* ModelBuild(u8* tmdData, u64 tmdDataSize) {
+    TmdPreprocess(tmdData, tmdDataSize);
 
-    TmdPreprocess(tmdData);
+    Arena* arena = ArenaCreate(ARENA_DEFAULT_BLOCK_SIZE);
 
-    model->_tmdDataOriginal = tmdData;
+    ModelData* model = (ModelData*)ArenaAlloc(arena, sizeof(ModelData));
+    model->_arena = arena;
+    model->_scratch = ArenaCreate(ARENA_DEFAULT_BLOCK_SIZE);
+
+    model->_tmdData = tmdData;
     model->_tmdDataSize = tmdDataSize;
 
-    model->_tmdData = (u8*)malloc(tmdDataSize);
-    memcpy(model->_tmdData, tmdData, tmdDataSize);
+    model->_vdf = NULL;
+    model->_keyInfluences = NULL;
+
+    model->_basePositions = NULL;
+    model->_workPositions = NULL;
+    model->_positionData = NULL;
+
+    model->_tmdOrderCacheMisses = 0;
+
+    model->_packs = NULL;
+    model->_packCount = 0;
+    model->_packFormat = MODEL_PACK_FLOAT;
+    model->_packRanges = NULL;
+    model->_staleSpans = NULL;
+
+    u32 objectCount = TmdGetObjectCount(tmdData);
+
+    model->_morphedRanges = (ModelVertexRange*)ArenaCalloc(arena, objectCount, sizeof(ModelVertexRange));
+    model->_dirtyRanges = (ModelVertexRange*)ArenaCalloc(arena, objectCount, sizeof(ModelVertexRange));
 
-    model->rModel = (Model*)malloc(sizeof(Model));
+    model->rModel = (Model*)ArenaAlloc(arena, sizeof(Model));
     *model->rModel = (Model){ 0 };
 
     {
-        model->rModel->meshCount = TmdGetObjectCount(model->_tmdData);
-        model->rModel->meshes = (Mesh*)calloc(model->rModel->meshCount, sizeof(Mesh));
-
-        for (unsigned m = 0; m < model->rModel->meshCount; m++) {
-            u32 primitiveCount = TmdObjectGetPrimitiveCount(model->_tmdData, m);
-            WorkPrimitive* primitives = TmdObjectCreateWorkPrimitives(model->_tmdData, m);
-
-            Mesh* mesh = model->rModel->meshes + m;
-            
-            unsigned totalVertices = 0;
-            unsigned totalIndices = 0;
-
-            for (unsigned i = 0; i < primitiveCount; i++) {
-                // Lines only use 2 vertices
-                if (primitives[i].flags.isLine) {
-                    totalVertices += 2;
-                    totalIndices += 2;
-                }
-                else {
-                    totalVertices += 3;
-                    totalIndices += 3;
-                }
-            }
+        // Usually one mesh per object; grown when objects are split
+        u32 meshCapacity = MAX(objectCount, 1);
+        model->rModel->meshes = (Mesh*)CountedCalloc(meshCapacity, sizeof(Mesh));
+        model->_vertexRemaps = (ModelVertexRemap*)CountedCalloc(meshCapacity, sizeof(ModelVertexRemap));
 
-            mesh->vertexCount = totalVertices;
-            mesh->vertices = (float*)malloc(mesh->vertexCount * 3 * sizeof(float));
-            mesh->normals = (float*)malloc(mesh->vertexCount * 3 * sizeof(float));
-        
-            mesh->colors = (u8*)malloc(mesh->vertexCount * 4);
-            mesh->triangleCount = totalIndices / 3; // Each triangle is 3 indices, lines count as separate
-            mesh->indices = (unsigned short*)malloc(totalIndices * sizeof(unsigned short));
+        model->_objectMeshes = (u32*)ArenaAlloc(arena, (objectCount + 1) * sizeof(u32));
 
-            mesh->texcoords = (float*)malloc(mesh->vertexCount * 2 * sizeof(float));
+        for (unsigned i = 0; i < objectCount; i++) {
+            model->_objectMeshes[i] = model->rModel->meshCount;
+            _ModelFillMeshes(model, i, &meshCapacity);
+        }
+        model->_objectMeshes[objectCount] = model->rModel->meshCount;
 
-            _ModelFillMesh(model, m);
+        model->_dirtySpans = (ModelDirtySpans*)ArenaCalloc(arena, model->rModel->meshCount, sizeof(ModelDirtySpans));
 
-            UploadMesh(mesh, 1);
-        }
+        u32 triangleCount = 0;
+        for (unsigned m = 0; m < model->rModel->meshCount; m++)
+            triangleCount += model->rModel->meshes[m].triangleCount;
+        model->tmdOrderAcmr = triangleCount ? model->_tmdOrderCacheMisses / (float)triangleCount : 0.f;
 
         model->rModel->transform = MatrixScale(-MODEL_SCALE, -MODEL_SCALE, -MODEL_SCALE);
     }
@@ -238,79 +681,637 @@ ModelData* ModelCreate(u8* tmdData, u32 tmdDataSize) {
     return model;
 }
 
-// Reset internal TMD model. ModelUpdate must be called before changes are reflected
-void ModelReset(ModelData* model) {
-    memcpy(model->_tmdData, model->_tmdDataOriginal, model->_tmdDataSize);
+u32 ModelGetObjectCount(ModelData* model) {
+    return TmdGetObjectCount(model->_tmdData);
 }
 
-// Assumes vertex & normal count have not changed. Does not realloc
-void ModelUpdate(ModelData* model) {
+// Meshes [first, end) of the model were built from the object
+void ModelGetObjectMeshRange(ModelData* model, u32 objectIndex, u32* first, u32* end) {
+    *first = model->_objectMeshes[objectIndex];
+    *end = model->_objectMeshes[objectIndex + 1];
+}
+
+// Average cache miss ratio of the meshes as they are now (see MeshCountCacheMisses)
+float ModelGetAcmr(ModelData* model) {
+    u32 misses = 0;
+    u32 triangleCount = 0;
+
     for (unsigned m = 0; m < model->rModel->meshCount; m++) {
-        _ModelFillMesh(model, m);
+        Mesh* mesh = model->rModel->meshes + m;
+
+        misses += MeshCountCacheMisses(mesh->indices, mesh->triangleCount, mesh->vertexCount);
+        triangleCount += mesh->triangleCount;
+    }
 
+    return triangleCount ? misses / (float)triangleCount : 0.f;
+}
+
+// Reorder the (already cache optimized) triangles of every mesh so the outward facing ones are
+// drawn first, for less overdraw at a slightly worse ACMR. Only call this before ModelUpload.
+void ModelOptimizeOverdraw(ModelData* model) {
+    for (unsigned m = 0; m < model->rModel->meshCount; m++) {
         Mesh* mesh = model->rModel->meshes + m;
 
-        UpdateMeshBuffer(*mesh, 0, mesh->vertices, mesh->vertexCount * 3 * sizeof(float), 0);
+        // The model transform mirrors the mesh through the origin; pass the positions as they are
+        // drawn, where front faces are counter-clockwise
+        ArenaReset(model->_scratch);
+        float* positions = (float*)ArenaAlloc(model->_scratch, mesh->vertexCount * 3 * sizeof(float));
+        for (int i = 0; i < mesh->vertexCount * 3; i++)
+            positions[i] = -mesh->vertices[i];
+
+        MeshOptimizeOverdraw(
+            mesh->indices, mesh->triangleCount, positions, mesh->vertexCount, MESH_OVERDRAW_THRESHOLD
+        );
+    }
+}
+
+// Upload the meshes of a model made with ModelBuild. Only positions change after this, so they
+// get a dynamic buffer and everything else static ones.
+void ModelUpload(ModelData* model) {
+    for (unsigned m = 0; m < model->rModel->meshCount; m++) {
+        Mesh* mesh = model->rModel->meshes + m;
+        UploadMesh(mesh, false);
+
+        // UploadMesh makes every buffer alike; replace the position one
+        rlEnableVertexArray(mesh->vaoId);
+        rlUnloadVertexBuffer(mesh->vboId[0]);
+        mesh->vboId[0] = rlLoadVertexBuffer(mesh->vertices, mesh->vertexCount * 3 * sizeof(float), true);
+        rlSetVertexAttribute(RL_DEFAULT_SHADER_ATTRIB_LOCATION_POSITION, 3, RL_FLOAT, 0, 0, 0);
+        rlEnableVertexAttribute(RL_DEFAULT_SHADER_ATTRIB_LOCATION_POSITION);
+        rlDisableVertexArray();
+    }
+}
+
+// Unload the GPU side only; a mesh's arrays are in the model's arena
+void _ModelUnloadMesh(Mesh mesh) {
+    mesh.vertices = mesh.normals = mesh.texcoords = mesh.texcoords2 = NULL;
+    mesh.colors = NULL;
+    mesh.indices = NULL;
+
+    UnloadMesh(mesh);
+}
+
+u32 _ModelPackPositionSize(ModelPackFormat format) {
+    return format == MODEL_PACK_COMPACT ? 4 * sizeof(s16) : 3 * sizeof(float);
+}
+
+u32 _ModelPackAttributeSize(ModelPackFormat format) {
+    return format == MODEL_PACK_COMPACT ? sizeof(ModelPackCompactAttributes) : sizeof(ModelPackAttributes);
+}
+
+// Signed normalized 10:10:10:2, as GL_INT_2_10_10_10_REV
+u32 _ModelPackNormal(float* normal) {
+    u32 packed = 0;
+    for (unsigned k = 0; k < 3; k++) {
+        s32 value = (s32)lrintf(Clamp(normal[k], -1.f, 1.f) * 511.f);
+        packed |= ((u32)value & 0x3FF) << (k * 10);
+    }
+
+    return packed;
+}
+
+// Copy the positions of mesh vertices [first, end) into the mesh's pack
+void _ModelPackWritePositions(ModelData* model, unsigned meshIndex, u32 first, u32 end) {
+    Mesh* mesh = model->rModel->meshes + meshIndex;
+    ModelPackRange* range = model->_packRanges + meshIndex;
+    ModelPack* pack = model->_packs + range->pack;
+
+    if (model->_packFormat == MODEL_PACK_FLOAT) {
+        memcpy(
+            (float*)pack->positions + (range->firstVertex + first) * 3, mesh->vertices + first * 3,
+            (end - first) * 3 * sizeof(float)
+        );
+        return;
+    }
+
+    s16* positions = (s16*)pack->positions + range->firstVertex * 4;
+    for (u32 v = first; v < end; v++) {
+        for (unsigned k = 0; k < 3; k++)
+            positions[v * 4 + k] = (s16)Clamp(lrintf(mesh->vertices[v * 3 + k]), -32768.f, 32767.f);
+        positions[v * 4 + 3] = 0; // Padding
+    }
+}
+
+// Copy the other attributes of mesh vertices [first, end) into the mesh's pack
+void _ModelPackWriteAttributes(ModelData* model, unsigned meshIndex, u32 first, u32 end) {
+    Mesh* mesh = model->rModel->meshes + meshIndex;
+    ModelPackRange* range = model->_packRanges + meshIndex;
+    ModelPack* pack = model->_packs + range->pack;
+
+    if (model->_packFormat == MODEL_PACK_FLOAT) {
+        for (u32 v = first; v < end; v++) {
+            ModelPackAttributes* attributes = (ModelPackAttributes*)pack->attributes + range->firstVertex + v;
+
+            memcpy(attributes->normal, mesh->normals + v * 3, sizeof(attributes->normal));
+            memcpy(attributes->texcoord, mesh->texcoords + v * 2, sizeof(attributes->texcoord));
+            memcpy(attributes->texcoord2, mesh->texcoords2 + v * 2, sizeof(attributes->texcoord2));
+            memcpy(attributes->color, mesh->colors + v * 4, sizeof(attributes->color));
+        }
+        return;
+    }
+
+    for (u32 v = first; v < end; v++) {
+        ModelPackCompactAttributes* attributes = (ModelPackCompactAttributes*)pack->attributes + range->firstVertex + v;
+
+        attributes->normal = _ModelPackNormal(mesh->normals + v * 3);
+
+        // Wrapped rather than clamped: a 15-bit page in the right half of VRAM can reach past
+        // its 4096 columns, and the shaders wrap those around like the float texcoords
+        for (unsigned k = 0; k < 2; k++)
+            attributes->texcoord[k] = (u16)(lrintf(mesh->texcoords[v * 2 + k] * 65536.f) & 0xFFFF);
+
+        float* texInfo = mesh->texcoords2 + v * 2;
+        if (texInfo[0] < 0.f) {
+            attributes->texcoord2[0] = 0xFFFF;
+            attributes->texcoord2[1] = 0;
+        }
+        else {
+            // The top bit of a tsb is unused, so a real one is never 0xFFFF
+            attributes->texcoord2[0] = (u16)texInfo[0] & 0x7FFF;
+            attributes->texcoord2[1] = (u16)texInfo[1];
+        }
+
+        memcpy(attributes->color, mesh->colors + v * 4, sizeof(attributes->color));
+    }
+}
+
+// Upload the positions of mesh vertices [first, end) from the mesh's pack to one of its buffers
+void _ModelPackUploadPositions(ModelData* model, unsigned meshIndex, u32 first, u32 end, u32 buffer) {
+    ModelPackRange* range = model->_packRanges + meshIndex;
+    ModelPack* pack = model->_packs + range->pack;
+
+    u32 positionSize = _ModelPackPositionSize(model->_packFormat);
+
+    rlUpdateVertexBuffer(
+        pack->positionVboIds[buffer], pack->positions + (range->firstVertex + first) * positionSize,
+        (end - first) * positionSize, (range->firstVertex + first) * positionSize
+    );
+}
+
+// Upload the other attributes of mesh vertices [first, end) from the mesh's pack
+void _ModelPackUploadAttributes(ModelData* model, unsigned meshIndex, u32 first, u32 end) {
+    ModelPackRange* range = model->_packRanges + meshIndex;
+    ModelPack* pack = model->_packs + range->pack;
+
+    u32 attributeSize = _ModelPackAttributeSize(model->_packFormat);
+
+    rlUpdateVertexBuffer(
+        pack->attributeVboId, pack->attributes + (range->firstVertex + first) * attributeSize,
+        (end - first) * attributeSize, (range->firstVertex + first) * attributeSize
+    );
+}
+
+// Upload the meshes of a model made with ModelBuild packed together, into as few packs as 16-bit
+// indices allow (usually one). Every pack is drawn with a single call instead of one per mesh, and
+// meshes are still updated separately through their range of the pack.
+// Call this before applying a texture, which needs to know the format.
+void ModelUploadPacked(ModelData* model, ModelPackFormat format) {
+    u32 meshCount = model->rModel->meshCount;
+    u32 positionSize = _ModelPackPositionSize(format);
+    u32 attributeSize = _ModelPackAttributeSize(format);
+
+    model->_packFormat = format;
+    model->_packRanges = (ModelPackRange*)ArenaAlloc(model->_arena, meshCount * sizeof(ModelPackRange));
+    model->_staleSpans = (ModelDirtySpans*)ArenaCalloc(model->_arena, meshCount, sizeof(ModelDirtySpans));
+
+    // There are never more packs than meshes
+    model->_packs = (ModelPack*)ArenaAlloc(model->_arena, MAX(meshCount, 1) * sizeof(ModelPack));
+
+    // Meshes go into the last pack, or a new one once it can't index them
+    for (unsigned m = 0; m < meshCount; m++) {
+        Mesh* mesh = model->rModel->meshes + m;
+
+        if (model->_packCount == 0 ||
+            model->_packs[model->_packCount - 1].vertexCount + mesh->vertexCount > MODEL_MAX_MESH_VERTICES) {
+            model->_packs[model->_packCount++] = (ModelPack){ .firstMesh = m };
+        }
+        ModelPack* pack = model->_packs + model->_packCount - 1;
+
+        model->_packRanges[m] = (ModelPackRange){ model->_packCount - 1, pack->vertexCount, pack->indexCount };
+
+        pack->vertexCount += mesh->vertexCount;
+        pack->indexCount += mesh->triangleCount * 3;
+        pack->endMesh = m + 1;
+    }
+
+    for (unsigned p = 0; p < model->_packCount; p++) {
+        ModelPack* pack = model->_packs + p;
+
+        pack->positions = (u8*)ArenaAlloc(model->_arena, pack->vertexCount * (positionSize + attributeSize));
+        pack->attributes = pack->positions + pack->vertexCount * positionSize;
+    }
+
+    ArenaReset(model->_scratch);
+
+    unsigned short** packIndices = (unsigned short**)ArenaAlloc(model->_scratch, model->_packCount * sizeof(unsigned short*));
+    for (unsigned p = 0; p < model->_packCount; p++)
+        packIndices[p] = (unsigned short*)ArenaAlloc(model->_scratch, model->_packs[p].indexCount * sizeof(unsigned short));
+
+    for (unsigned m = 0; m < meshCount; m++) {
+        Mesh* mesh = model->rModel->meshes + m;
+        ModelPackRange* range = model->_packRanges + m;
+
+        _ModelPackWritePositions(model, m, 0, mesh->vertexCount);
+        _ModelPackWriteAttributes(model, m, 0, mesh->vertexCount);
+
+        unsigned short* indices = packIndices[range->pack] + range->firstIndex;
+        for (int i = 0; i < mesh->triangleCount * 3; i++)
+            indices[i] = mesh->indices[i] + range->firstVertex;
+    }
+
+    // Same locations raylib binds the attributes of every shader to
+    typedef struct {
+        u32 location;
+        int size, type, normalized;
+        u32 offset;
+    } Attribute;
+
+    static const Attribute floatAttributes[] = {
+        { RL_DEFAULT_SHADER_ATTRIB_LOCATION_POSITION, 3, RL_FLOAT, 0, 0 },
+        { RL_DEFAULT_SHADER_ATTRIB_LOCATION_NORMAL, 3, RL_FLOAT, 0, offsetof(ModelPackAttributes, normal) },
+        { RL_DEFAULT_SHADER_ATTRIB_LOCATION_TEXCOORD, 2, RL_FLOAT, 0, offsetof(ModelPackAttributes, texcoord) },
+        { RL_DEFAULT_SHADER_ATTRIB_LOCATION_TEXCOORD2, 2, RL_FLOAT, 0, offsetof(ModelPackAttributes, texcoord2) },
+        { RL_DEFAULT_SHADER_ATTRIB_LOCATION_COLOR, 4, RL_UNSIGNED_BYTE, 1, offsetof(ModelPackAttributes, color) }
+    };
+    static const Attribute compactAttributes[] = {
+        { RL_DEFAULT_SHADER_ATTRIB_LOCATION_POSITION, 3, MODEL_GL_SHORT, 0, 0 },
+        { RL_DEFAULT_SHADER_ATTRIB_LOCATION_NORMAL, 4, MODEL_GL_INT_2_10_10_10_REV, 1, offsetof(ModelPackCompactAttributes, normal) },
+        { RL_DEFAULT_SHADER_ATTRIB_LOCATION_TEXCOORD, 2, MODEL_GL_UNSIGNED_SHORT, 0, offsetof(ModelPackCompactAttributes, texcoord) },
+        { RL_DEFAULT_SHADER_ATTRIB_LOCATION_TEXCOORD2, 2, MODEL_GL_UNSIGNED_SHORT, 0, offsetof(ModelPackCompactAttributes, texcoord2) },
+        { RL_DEFAULT_SHADER_ATTRIB_LOCATION_COLOR, 4, RL_UNSIGNED_BYTE, 1, offsetof(ModelPackCompactAttributes, color) }
+    };
+    const Attribute* attributes = format == MODEL_PACK_COMPACT ? compactAttributes : floatAttributes;
+    u32 attributeCount = sizeof(floatAttributes) / sizeof(Attribute);
+
+    for (unsigned p = 0; p < model->_packCount; p++) {
+        ModelPack* pack = model->_packs + p;
+
+        // The VAOs share the attribute & index buffers, and each has its own position buffer
+        for (u32 b = 0; b < 2; b++) {
+            pack->vaoIds[b] = rlLoadVertexArray();
+            rlEnableVertexArray(pack->vaoIds[b]);
+
+            pack->positionVboIds[b] = rlLoadVertexBuffer(pack->positions, pack->vertexCount * positionSize, true);
+            rlSetVertexAttribute(
+                attributes[0].location, attributes[0].size, attributes[0].type, attributes[0].normalized,
+                positionSize, attributes[0].offset
+            );
+            rlEnableVertexAttribute(attributes[0].location);
+
+            if (b == 0)
+                pack->attributeVboId = rlLoadVertexBuffer(pack->attributes, pack->vertexCount * attributeSize, false);
+            else
+                rlEnableVertexBuffer(pack->attributeVboId);
+
+            for (u32 i = 1; i < attributeCount; i++) {
+                rlSetVertexAttribute(
+                    attributes[i].location, attributes[i].size, attributes[i].type, attributes[i].normalized,
+                    attributeSize, attributes[i].offset
+                );
+                rlEnableVertexAttribute(attributes[i].location);
+            }
+
+            if (b == 0)
+                pack->iboId = rlLoadVertexBufferElement(packIndices[p], pack->indexCount * sizeof(unsigned short), false);
+            else
+                rlEnableVertexBufferElement(pack->iboId);
+
+            rlDisableVertexArray();
+        }
+    }
+}
+
+// Upload the positions that changed since the last update to the position buffer of each pack
+// that was not drawn last, then switch to drawing it. That buffer also missed the previous
+// update's changes, so those go with them.
+void _ModelUpdatePacks(ModelData* model) {
+    for (unsigned p = 0; p < model->_packCount; p++) {
+        ModelPack* pack = model->_packs + p;
+
+        int changed = 0;
+        for (u32 m = pack->firstMesh; m < pack->endMesh; m++)
+            changed |= model->_dirtySpans[m].count != 0;
+        if (!changed)
+            continue;
+
+        u32 next = !pack->current;
+
+        for (u32 m = pack->firstMesh; m < pack->endMesh; m++) {
+            ModelDirtySpans* dirty = model->_dirtySpans + m;
+            ModelDirtySpans* stale = model->_staleSpans + m;
+
+            _ModelDirtySpansMerge(dirty);
+            for (u32 s = 0; s < dirty->count; s++)
+                _ModelPackWritePositions(model, m, dirty->spans[s].first, dirty->spans[s].end);
+
+            ModelDirtySpans upload = *dirty;
+            for (u32 s = 0; s < stale->count; s++)
+                _ModelDirtySpansAdd(&upload, stale->spans[s].first, stale->spans[s].end);
+            _ModelDirtySpansMerge(&upload);
+
+            for (u32 s = 0; s < upload.count; s++)
+                _ModelPackUploadPositions(model, m, upload.spans[s].first, upload.spans[s].end, next);
+
+            // Now only in the next buffer
+            *stale = *dirty;
+            dirty->count = 0;
+        }
+
+        pack->current = next;
+    }
+}
+
+// Draw the packs with the model's first material (the only one it has), the way DrawModelEx
+// draws meshes
+void _ModelDrawPacks(ModelData* model) {
+    Model* rModel = model->rModel;
+    if (rModel->materialCount == 0)
+        return;
+
+    Material* material = rModel->materials;
+    int* locs = material->shader.locs;
+
+    Matrix matTransform = MatrixMultiply(
+        MatrixMultiply(
+            MatrixScale(model->scale.x, model->scale.y, model->scale.z),
+            MatrixRotate(model->rotationAxis, model->rotationAngle * DEG2RAD)
+        ),
+        MatrixTranslate(model->position.x, model->position.y, model->position.z)
+    );
+    Matrix matModel = MatrixMultiply(MatrixMultiply(rModel->transform, matTransform), rlGetMatrixTransform());
+    Matrix matView = rlGetMatrixModelview();
+    Matrix matProjection = rlGetMatrixProjection();
+
+    rlEnableShader(material->shader.id);
+
+    if (locs[SHADER_LOC_COLOR_DIFFUSE] != -1) {
+        Color color = material->maps[MATERIAL_MAP_DIFFUSE].color;
+        float diffuse[4] = {
+            color.r / 255.f * (model->tint.r / 255.f), color.g / 255.f * (model->tint.g / 255.f),
+            color.b / 255.f * (model->tint.b / 255.f), color.a / 255.f * (model->tint.a / 255.f)
+        };
+        rlSetUniform(locs[SHADER_LOC_COLOR_DIFFUSE], diffuse, RL_SHADER_UNIFORM_VEC4, 1);
+    }
+
+    if (locs[SHADER_LOC_MATRIX_VIEW] != -1)
+        rlSetUniformMatrix(locs[SHADER_LOC_MATRIX_VIEW], matView);
+    if (locs[SHADER_LOC_MATRIX_PROJECTION] != -1)
+        rlSetUniformMatrix(locs[SHADER_LOC_MATRIX_PROJECTION], matProjection);
+    if (locs[SHADER_LOC_MATRIX_MODEL] != -1)
+        rlSetUniformMatrix(locs[SHADER_LOC_MATRIX_MODEL], matModel);
+    if (locs[SHADER_LOC_MATRIX_NORMAL] != -1)
+        rlSetUniformMatrix(locs[SHADER_LOC_MATRIX_NORMAL], MatrixTranspose(MatrixInvert(matModel)));
+    rlSetUniformMatrix(locs[SHADER_LOC_MATRIX_MVP], MatrixMultiply(MatrixMultiply(matModel, matView), matProjection));
+
+    // Only the diffuse map is ever set on our materials
+    Texture2D texture = material->maps[MATERIAL_MAP_DIFFUSE].texture;
+    if (texture.id > 0) {
+        int slot = 0;
+        rlActiveTextureSlot(slot);
+        rlEnableTexture(texture.id);
+        rlSetUniform(locs[SHADER_LOC_MAP_DIFFUSE], &slot, RL_SHADER_UNIFORM_INT, 1);
+    }
+
+    for (unsigned p = 0; p < model->_packCount; p++) {
+        ModelPack* pack = model->_packs + p;
+
+        rlEnableVertexArray(pack->vaoIds[pack->current]);
+        rlDrawVertexArrayElements(0, pack->indexCount, 0);
+    }
+
+    if (texture.id > 0) {
+        rlActiveTextureSlot(0);
+        rlDisableTexture();
+    }
+
+    rlDisableVertexArray();
+    rlDisableVertexBuffer();
+    rlDisableVertexBufferElement();
+
+    rlDisableShader();
+
+    rlSetMatrixModelview(matView);
+    rlSetMatrixProjection(matProjection);
+}
+
+ModelData* ModelCreate(u8* tmdData, u64 tmdDataSize) {
+    ModelData* model = ModelBuild(tmdData, tmdDataSize);
+    ModelUpload(model);
+
+    return model;
+}
+
+
+// Only positions are updated; they are scattered from the work positions for the vertices
+// changed since the last update, and only the spans of the meshes they land in get uploaded.
+// Objects that did not change are skipped.
+void ModelUpdate(ModelData* model) {
+    u32 objectCount = TmdGetObjectCount(model->_tmdData);
+    for (unsigned i = 0; i < objectCount; i++) {
+        ModelVertexRange* dirtyRange = model->_dirtyRanges + i;
+        if (dirtyRange->first >= dirtyRange->end)
+            continue;
+
+        for (u32 m = model->_objectMeshes[i]; m < model->_objectMeshes[i + 1]; m++)
+            _ModelScatterPositions(model, i, m, dirtyRange->first, dirtyRange->end);
+
+        *dirtyRange = (ModelVertexRange){ 0 };
+    }
+
+    if (model->_packs) {
+        _ModelUpdatePacks(model);
+        return;
+    }
+
+    for (unsigned m = 0; m < model->rModel->meshCount; m++) {
+        Mesh* mesh = model->rModel->meshes + m;
+
+        ModelDirtySpans* dirty = model->_dirtySpans + m;
+        _ModelDirtySpansMerge(dirty);
+
+        for (u32 s = 0; s < dirty->count; s++) {
+            ModelVertexRange* span = dirty->spans + s;
+
+            UpdateMeshBuffer(
+                *mesh, 0, mesh->vertices + span->first * 3,
+                (span->end - span->first) * 3 * sizeof(float), span->first * 3 * sizeof(float)
+            );
+        }
+        dirty->count = 0;
     }
 }
 
 // Frees model ptr
 void ModelDestroy(ModelData* model) {
     for (unsigned m = 0; m < model->rModel->meshCount; m++)
-        UnloadMesh(model->rModel->meshes[m]);
+        _ModelUnloadMesh(model->rModel->meshes[m]);
     for (unsigned m = 0; m < model->rModel->materialCount; m++)
         UnloadMaterial(model->rModel->materials[m]);
 
-    free(model->_tmdData);
+    for (unsigned p = 0; p < model->_packCount; p++) {
+        ModelPack* pack = model->_packs + p;
+
+        for (u32 b = 0; b < 2; b++) {
+            rlUnloadVertexArray(pack->vaoIds[b]);
+            rlUnloadVertexBuffer(pack->positionVboIds[b]);
+        }
+        rlUnloadVertexBuffer(pack->attributeVboId);
+        rlUnloadVertexBuffer(pack->iboId);
+    }
+
+    CountedFree(model->_vertexRemaps);
 
-    free(model);
+    CountedFree(model->rModel->meshes);
+    CountedFree(model->rModel->materials);
+    CountedFree(model->rModel->meshMaterial);
+
+    ArenaDestroy(model->_scratch);
+    // The model itself is in it
+    ArenaDestroy(model->_arena);
 }
 
-// Apply Vdf data from Dat
-void ModelApplyDatVdf(ModelData* model, u8* vdfData, u8* datData, float frameNo) {
-    TmdVertex* vertices = TmdObjectGetVertices(model->_tmdData, 0);
+// Attach the VDF whose keys will be applied to the model, making float copies of the vertex
+// ranges they can touch. A key touches the object it targets when applied directly and the
+// first object when driven by a DAT. Keys that don't fit an object panic once applied to it.
+void ModelAttachVdf(ModelData* model, VdfData* vdf) {
+    if (model->_vdf != NULL)
+        panic("A VDF is already attached to the model");
+
+    u32 objectCount = TmdGetObjectCount(model->_tmdData);
+    u32 keyCount = VdfGetKeyCount(vdf);
+
+    model->_vdf = vdf;
+    model->_keyInfluences = (float*)ArenaCalloc(model->_arena, keyCount, sizeof(float));
+
+    ArenaReset(model->_scratch);
+
+    // Union of the key ranges per object
+    ModelVertexRange* windows = (ModelVertexRange*)ArenaCalloc(model->_scratch, objectCount, sizeof(ModelVertexRange));
+    for (unsigned i = 0; i < keyCount; i++) {
+        u32 first, end;
+        VdfGetKeyVertexRange(vdf, i, &first, &end);
+
+        if (objectCount > 0 && end <= TmdObjectGetVertexCount(model->_tmdData, 0))
+            _ModelVertexRangeAdd(windows + 0, first, end);
+
+        u32 objectIndex = VdfGetKeyObjectIndex(vdf, i);
+        if (objectIndex < objectCount && end <= TmdObjectGetVertexCount(model->_tmdData, objectIndex))
+            _ModelVertexRangeAdd(windows + objectIndex, first, end);
+    }
+
+    u64 totalVertices = 0;
+    for (unsigned i = 0; i < objectCount; i++) {
+        if (windows[i].first < windows[i].end)
+            totalVertices += windows[i].end - windows[i].first;
+    }
+
+    model->_basePositions = (VdfPositions*)ArenaCalloc(model->_arena, objectCount, sizeof(VdfPositions));
+    model->_workPositions = (VdfPositions*)ArenaCalloc(model->_arena, objectCount, sizeof(VdfPositions));
+    model->_positionData = (float*)ArenaAlloc(model->_arena, totalVertices * 6 * sizeof(float));
 
-    DatApplyVdf(datData, vdfData, vertices, frameNo);
+    float* positionData = model->_positionData;
+    for (unsigned i = 0; i < objectCount; i++) {
+        ModelVertexRange* window = windows + i;
+        if (window->first >= window->end)
+            continue;
+
+        u32 vertexCount = window->end - window->first;
+        TmdVertex* vertices = TmdObjectGetVertices(model->_tmdData, i) + window->first;
+
+        VdfPositions* base = model->_basePositions + i;
+        VdfPositions* work = model->_workPositions + i;
+
+        base->x = positionData;
+        base->y = base->x + vertexCount;
+        base->z = base->y + vertexCount;
+        work->x = base->z + vertexCount;
+        work->y = work->x + vertexCount;
+        work->z = work->y + vertexCount;
+        positionData = work->z + vertexCount;
+
+        base->first = work->first = window->first;
+
+        for (unsigned j = 0; j < vertexCount; j++) {
+            base->x[j] = vertices[j].x;
+            base->y[j] = vertices[j].y;
+            base->z[j] = vertices[j].z;
+        }
+        memcpy(work->x, base->x, vertexCount * 3 * sizeof(float));
+    }
 }
 
-// Directly apply Vdf keyframe
-void ModelApplyVdf(ModelData* model, u8* vdfData, u32 keyIndex, float influence) {
-    u32 objectIndex = VdfGetKeyObjectIndex(vdfData, keyIndex);
-    TmdVertex* vertices = TmdObjectGetVertices(model->_tmdData, objectIndex);
+void _ModelApplyVdfKey(ModelData* model, u32 keyIndex, float influence, u32 objectIndex) {
+    u32 first, end;
+    VdfGetKeyVertexRange(model->_vdf, keyIndex, &first, &end);
+
+    _ModelMarkMorphed(model, objectIndex, first, end);
 
-    VdfApply(vdfData, keyIndex, influence, vertices);
+    // An empty key may be applied to an object no other key touches, which then has no positions
+    if (first < end)
+        VdfApply(model->_vdf, keyIndex, influence, model->_workPositions + objectIndex);
+}
+
+// Directly apply Vdf keyframe of the attached VDF
+void ModelApplyVdf(ModelData* model, u32 keyIndex, float influence) {
+    if (model->_vdf == NULL)
+        panic("No VDF is attached to the model");
+
+    _ModelApplyVdfKey(model, keyIndex, influence, VdfGetKeyObjectIndex(model->_vdf, keyIndex));
+}
+
+// Apply the attached VDF's keys with the influences of a DAT frame. Keys with no influence
+// at this frame are skipped entirely.
+void ModelApplyDatVdf(ModelData* model, DatData* dat, float frameNo) {
+    if (model->_vdf == NULL)
+        panic("No VDF is attached to the model");
+
+    u32 keyCount = VdfGetKeyCount(model->_vdf);
+    DatGetInfluences(dat, frameNo, model->_keyInfluences, keyCount);
+
+    // Every key is applied to the first object
+    for (unsigned i = 0; i < keyCount; i++) {
+        if (model->_keyInfluences[i] != 0.f)
+            _ModelApplyVdfKey(model, i, model->_keyInfluences[i], 0);
+    }
 }
 
 void ModelApplyDefaultMaterial(ModelData* model) {
     if (model->rModel->materials)
-        free(model->rModel->materials);
+        CountedFree(model->rModel->materials);
     if (model->rModel->meshMaterial)
-        free(model->rModel->meshMaterial);
+        CountedFree(model->rModel->meshMaterial);
 
     model->rModel->materialCount = 1;
-    model->rModel->materials = (Material *)calloc(1, sizeof(Material));
+    model->rModel->materials = (Material *)CountedCalloc(1, sizeof(Material));
 
     model->rModel->materials[0] = LoadMaterialDefault();
 
-    model->rModel->meshMaterial = (int*)calloc(model->rModel->meshCount, sizeof(int));
+    model->rModel->meshMaterial = (int*)CountedCalloc(model->rModel->meshCount, sizeof(int));
 }
 
-// Directly apply texture to model (Texture2D)
-void ModelApplyTexture(ModelData* model, Texture2D texture) {
+void _ModelApplyShadedTexture(ModelData* model, Texture2D texture, const char* vertexShader, const char* fragmentShader) {
     if (model->rModel->materials)
-        free(model->rModel->materials);
+        CountedFree(model->rModel->materials);
     if (model->rModel->meshMaterial)
-        free(model->rModel->meshMaterial);
+        CountedFree(model->rModel->meshMaterial);
 
     model->rModel->materialCount = 1;
-    model->rModel->materials = (Material *)calloc(1, sizeof(Material));
+    model->rModel->materials = (Material *)CountedCalloc(1, sizeof(Material));
 
     model->rModel->materials[0] = LoadMaterialDefault();
     model->rModel->materials[0].maps[MATERIAL_MAP_DIFFUSE].texture = texture;
 
-    model->rModel->materials[0].shader = LoadShaderFromMemory(0, MAT_SHADER);
+    // Compact packs need their own vertex shader, whatever the fragment shader
+    if (model->_packs && model->_packFormat == MODEL_PACK_COMPACT)
+        vertexShader = COMPACT_VERTEX_SHADER;
+    model->rModel->materials[0].shader = LoadShaderFromMemory(vertexShader, fragmentShader);
 
-    model->rModel->meshMaterial = (int*)calloc(model->rModel->meshCount, sizeof(int));
+    model->rModel->meshMaterial = (int*)CountedCalloc(model->rModel->meshCount, sizeof(int));
+}
+
+// Directly apply texture to model (Texture2D)
+void ModelApplyTexture(ModelData* model, Texture2D texture) {
+    _ModelApplyShadedTexture(model, texture, NULL, MAT_SHADER);
 }
 
 // Apply texture to model from Image
@@ -320,11 +1321,104 @@ void ModelApplyImageTexture(ModelData* model, Image image) {
     ModelApplyTexture(model, texture);
 }
 
+// Apply a native VRAM texture (see VRAM_SHADER), e.g. from a native VrTexture
+void ModelApplyVramTexture(ModelData* model, Texture2D texture) {
+    _ModelApplyShadedTexture(model, texture, VRAM_VERTEX_SHADER, VRAM_SHADER);
+}
+
+// Texture the model from a TexCache: every (page, CLUT) its textured primitives use is decoded
+// into the cache's atlas and their texcoords are moved from VRAM to the atlas. Only call this
+// once per model, as it rewrites the texcoords. Returns 0, leaving the model untouched, if the
+// combinations don't all fit in the atlas.
+int ModelApplyCacheTexture(ModelData* model, TexCache* cache) {
+    ArenaReset(model->_scratch);
+
+    u32** vertexSlots = (u32**)ArenaAlloc(model->_scratch, model->rModel->meshCount * sizeof(u32*));
+
+    // Find the slots first; the atlas size (and so the texcoord scale) is only known after
+    for (unsigned m = 0; m < model->rModel->meshCount; m++) {
+        Mesh* mesh = model->rModel->meshes + m;
+        vertexSlots[m] = (u32*)ArenaAlloc(model->_scratch, mesh->vertexCount * sizeof(u32));
+
+        for (int i = 0; i < mesh->vertexCount; i++) {
+            float* texInfo = mesh->texcoords2 + i * 2;
+            if (texInfo[0] < 0.f)
+                continue;
+
+            vertexSlots[m][i] = TexCacheGetSlot(cache, (u16)texInfo[0], (u16)texInfo[1]);
+            if (vertexSlots[m][i] == TEX_CACHE_NO_SLOT)
+                return 0;
+        }
+    }
+
+    for (unsigned m = 0; m < model->rModel->meshCount; m++) {
+        Mesh* mesh = model->rModel->meshes + m;
+
+        for (int i = 0; i < mesh->vertexCount; i++) {
+            float* texInfo = mesh->texcoords2 + i * 2;
+            if (texInfo[0] < 0.f)
+                continue;
+
+            u16 tsb = (u16)texInfo[0];
+            u32 tpage = TSB_GET_TPAGE(tsb);
+            u32 uScale = 1 << MIN(TSB_GET_TPF(tsb), 2);
+
+            // Back from VRAM columns (see _TmdEmitPrimitive) to the primitive's own UV
+            float* texcoord = mesh->texcoords + i * 2;
+            u32 column = (u32)(texcoord[0] * VR_WIDTH32);
+            u32 row = (u32)(texcoord[1] * VR_HEIGHT);
+
+            u32 u = (column - (tpage * VR_PAGE_WIDTH32) % VR_WIDTH32) / uScale;
+            u32 v = row - (tpage >= 16 ? VR_PAGE_HEIGHT : 0);
+
+            u32 slot = vertexSlots[m][i];
+            texcoord[0] = ((slot % TEX_CACHE_SLOTS_PER_ROW) * TEX_CACHE_SLOT_SIZE + u) / (float)TEX_CACHE_ATLAS_WIDTH;
+            texcoord[1] = ((slot / TEX_CACHE_SLOTS_PER_ROW) * TEX_CACHE_SLOT_SIZE + v) / (float)cache->atlasHeight;
+        }
+
+        if (model->_packs) {
+            _ModelPackWriteAttributes(model, m, 0, mesh->vertexCount);
+            _ModelPackUploadAttributes(model, m, 0, mesh->vertexCount);
+        }
+        else if (mesh->vboId)
+            UpdateMeshBuffer(*mesh, 1, mesh->texcoords, mesh->vertexCount * 2 * sizeof(float), 0);
+    }
+
+    Image image = { 0 };
+    image.format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8;
+    image.mipmaps = 1;
+
+    u32 blank = 0;
+    if (cache->atlasHeight == 0) {
+        // Nothing is textured
+        image.width = image.height = 1;
+        image.data = &blank;
+    }
+    else {
+        image.width = TEX_CACHE_ATLAS_WIDTH;
+        image.height = cache->atlasHeight;
+        image.data = cache->atlas;
+    }
+
+    ModelApplyTexture(model, LoadTextureFromImage(image));
+
+    return 1;
+}
+
 void ModelSubmitDraw(ModelData* model) {
-    DrawModelEx(*model->rModel, model->position, model->rotationAxis, model->rotationAngle, model->scale, model->tint);
+    if (model->_packs)
+        _ModelDrawPacks(model);
+    else
+        DrawModelEx(*model->rModel, model->position, model->rotationAxis, model->rotationAngle, model->scale, model->tint);
 }
 void ModelSubmitWireDraw(ModelData* model) {
-    DrawModelWiresEx(*model->rModel, model->position, model->rotationAxis, model->rotationAngle, model->scale, model->tint);
+    if (model->_packs) {
+        rlEnableWireMode();
+        _ModelDrawPacks(model);
+        rlDisableWireMode();
+    }
+    else
+        DrawModelWiresEx(*model->rModel, model->position, model->rotationAxis, model->rotationAngle, model->scale, model->tint);
 }
 
 #endif
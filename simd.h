@@ -0,0 +1,39 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include "common.h"
+
+// SIMD kernels are compiled per function with __attribute__((target(...))) and picked at
+// runtime, so the binary still runs on CPUs without the extensions. Non-x86 targets only
+// ever use the scalar paths.
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86 (1)
+
+#include <immintrin.h>
+#endif
+
+int SimdHasSse2(void) {
+#ifdef SIMD_X86
+    return __builtin_cpu_supports("sse2");
+#else
+    return 0;
+#endif
+}
+
+int SimdHasSsse3(void) {
+#ifdef SIMD_X86
+    return __builtin_cpu_supports("ssse3");
+#else
+    return 0;
+#endif
+}
+
+int SimdHasAvx2(void) {
+#ifdef SIMD_X86
+    return __builtin_cpu_supports("avx2");
+#else
+    return 0;
+#endif
+}
+
+#endif
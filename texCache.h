@@ -0,0 +1,139 @@
+#ifndef TEX_CACHE_H
+#define TEX_CACHE_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tmdProcess.h"
+#include "timProcess.h"
+
+#include "allocStats.h"
+#include "common.h"
+
+// Decodes (texture page, CLUT) combinations of native VRAM (as filled by TimVrCopy16) into
+// 256x256 slots of an RGBA atlas, the first time each one is asked for. Primitives that use
+// several palettes on the same page each get their own correctly colored copy, and VRAM that no
+// primitive references is never decoded.
+
+#define TEX_CACHE_SLOT_SIZE (256)
+#define TEX_CACHE_SLOTS_PER_ROW (8)
+#define TEX_CACHE_ATLAS_WIDTH (TEX_CACHE_SLOT_SIZE * TEX_CACHE_SLOTS_PER_ROW)
+
+// Kept loadable everywhere: GL 3.3 implies D3D10-class hardware, which supports 8192x8192
+#define TEX_CACHE_MAX_ATLAS_HEIGHT (8192)
+
+// What TexCacheGetSlot returns once the atlas is full
+#define TEX_CACHE_NO_SLOT (0xFFFFFFFFu)
+
+// Everything of a tsb that changes the decoded texels (page and color mode), with the cba for
+// the modes that go through a CLUT
+#define TEX_CACHE_KEY(tsb, cba) \
+    (((u32)(tsb) & 0x19F) | (TSB_GET_TPF((tsb)) >= 2 ? 0 : (u32)(cba) << 16))
+
+typedef struct {
+    u16* _vr; // Native VRAM (not owned)
+
+    u32 slotCount;
+    u32 _slotCapacity;
+    u32* _slotKeys;
+
+    // TEX_CACHE_ATLAS_WIDTH x atlasHeight, grown a row of slots at a time up to
+    // TEX_CACHE_MAX_ATLAS_HEIGHT
+    u32* atlas;
+    u32 atlasHeight;
+} TexCache;
+
+TexCache* TexCacheCreate(u16* vr) {
+    TexCache* cache = (TexCache*)CountedCalloc(1, sizeof(TexCache));
+    cache->_vr = vr;
+
+    return cache;
+}
+
+void TexCacheDestroy(TexCache* cache) {
+    CountedFree(cache->_slotKeys);
+    CountedFree(cache->atlas);
+
+    CountedFree(cache);
+}
+
+void _TexCacheDecodeSlot(TexCache* cache, u32 slot, u16 tsb, u16 cba) {
+    u16* vr = cache->_vr;
+
+    u32 tpage = TSB_GET_TPAGE(tsb);
+    u32 tpf = TSB_GET_TPF(tsb);
+
+    u32 pageX = (tpage % 16) * VR_PAGE_WIDTH;
+    u32 pageY = (tpage / 16) * VR_PAGE_HEIGHT;
+
+    u32 palette[256];
+    if (tpf < 2) {
+        u32 paletteSize = tpf == 0 ? 16 : 256;
+
+        u32 clutX = CBA_GET_CBX(cba) * 16;
+        u32 clutY = CBA_GET_CBY(cba) % VR_HEIGHT;
+        for (unsigned i = 0; i < paletteSize; i++)
+            palette[i] = _TimColor15ToRgba(vr[clutY * VR_WIDTH + (clutX + i) % VR_WIDTH]);
+    }
+
+    u32* dst = cache->atlas +
+        (slot / TEX_CACHE_SLOTS_PER_ROW) * TEX_CACHE_SLOT_SIZE * TEX_CACHE_ATLAS_WIDTH +
+        (slot % TEX_CACHE_SLOTS_PER_ROW) * TEX_CACHE_SLOT_SIZE;
+
+    for (u32 v = 0; v < TEX_CACHE_SLOT_SIZE; v++) {
+        u16* row = vr + ((pageY + v) % VR_HEIGHT) * VR_WIDTH;
+        u32* dstRow = dst + v * TEX_CACHE_ATLAS_WIDTH;
+
+        for (u32 u = 0; u < TEX_CACHE_SLOT_SIZE; u++) {
+            u32 color;
+            if (tpf == 0) {
+                u16 word = row[(pageX + u / 4) % VR_WIDTH];
+                color = palette[(word >> ((u % 4) * 4)) & 0x0F];
+            }
+            else if (tpf == 1) {
+                u16 word = row[(pageX + u / 2) % VR_WIDTH];
+                color = palette[(word >> ((u % 2) * 8)) & 0xFF];
+            }
+            else
+                color = _TimColor15ToRgba(row[(pageX + u) % VR_WIDTH]);
+
+            dstRow[u] = color;
+        }
+    }
+}
+
+// Atlas slot holding the texels a primitive with this tsb & cba samples; decoded on first use.
+// TEX_CACHE_NO_SLOT if it is new and the atlas has no room left for it.
+u32 TexCacheGetSlot(TexCache* cache, u16 tsb, u16 cba) {
+    u32 key = TEX_CACHE_KEY(tsb, cba);
+
+    // Models reference few combinations, so a linear search is enough
+    for (u32 i = 0; i < cache->slotCount; i++) {
+        if (cache->_slotKeys[i] == key)
+            return i;
+    }
+
+    if (cache->slotCount == cache->_slotCapacity && cache->atlasHeight + TEX_CACHE_SLOT_SIZE > TEX_CACHE_MAX_ATLAS_HEIGHT)
+        return TEX_CACHE_NO_SLOT;
+
+    u32 slot = cache->slotCount++;
+
+    if (slot == cache->_slotCapacity) {
+        cache->_slotCapacity += TEX_CACHE_SLOTS_PER_ROW;
+        cache->_slotKeys = (u32*)CountedRealloc(cache->_slotKeys, cache->_slotCapacity * sizeof(u32));
+
+        // Add a (cleared) row of slots to the atlas
+        u64 rowPixels = (u64)TEX_CACHE_SLOT_SIZE * TEX_CACHE_ATLAS_WIDTH;
+        cache->atlas = (u32*)CountedRealloc(cache->atlas, (cache->atlasHeight + TEX_CACHE_SLOT_SIZE) * TEX_CACHE_ATLAS_WIDTH * sizeof(u32));
+        memset(cache->atlas + (u64)cache->atlasHeight * TEX_CACHE_ATLAS_WIDTH, 0, rowPixels * sizeof(u32));
+
+        cache->atlasHeight += TEX_CACHE_SLOT_SIZE;
+    }
+
+    cache->_slotKeys[slot] = key;
+    _TexCacheDecodeSlot(cache, slot, tsb, cba);
+
+    return slot;
+}
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stdlib.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "common.h"
+
+typedef void (*ThreadPoolJobFunc)(void* user, u32 jobIndex);
+
+typedef struct {
+    ThreadPoolJobFunc func;
+    void* user;
+
+    u32 jobCount;
+    u32 nextJob; // Claimed atomically by the workers
+} _ThreadPoolWork;
+
+void* _ThreadPoolWorker(void* arg) {
+    _ThreadPoolWork* work = (_ThreadPoolWork*)arg;
+
+    while (1) {
+        u32 jobIndex = __atomic_fetch_add(&work->nextJob, 1, __ATOMIC_RELAXED);
+        if (jobIndex >= work->jobCount)
+            break;
+
+        work->func(work->user, jobIndex);
+    }
+
+    return NULL;
+}
+
+// Number of worker threads to use when none is requested
+u32 ThreadPoolGetDefaultThreadCount(void) {
+#ifdef _SC_NPROCESSORS_ONLN
+    long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpuCount > 0)
+        return (u32)cpuCount;
+#endif
+    return 1;
+}
+
+// Run func for every job index in [0, jobCount) on up to threadCount threads (the calling thread
+// being one of them) and wait for all of them to finish. Jobs are handed out in order, one at a
+// time, so uneven jobs still balance out.
+void ThreadPoolRun(u32 threadCount, u32 jobCount, ThreadPoolJobFunc func, void* user) {
+    _ThreadPoolWork work = { 0 };
+    work.func = func;
+    work.user = user;
+    work.jobCount = jobCount;
+
+    threadCount = MIN(threadCount, jobCount);
+    if (threadCount <= 1) {
+        _ThreadPoolWorker(&work);
+        return;
+    }
+
+    pthread_t* threads = (pthread_t*)malloc((threadCount - 1) * sizeof(pthread_t));
+    for (unsigned i = 0; i < threadCount - 1; i++) {
+        if (pthread_create(threads + i, NULL, _ThreadPoolWorker, &work) != 0)
+            panic("Failed to create a worker thread");
+    }
+
+    _ThreadPoolWorker(&work);
+
+    for (unsigned i = 0; i < threadCount - 1; i++)
+        pthread_join(threads[i], NULL);
+
+    free(threads);
+}
+
+#endif
@@ -5,6 +5,10 @@
 
 #include <string.h>
 
+#include "simd.h"
+#include "threadPool.h"
+
+#include "allocStats.h"
 #include "common.h"
 
 #define VR_PAGE_WIDTH (64)
@@ -34,7 +38,7 @@ typedef struct __attribute((packed)) {
 #define TIM_PMODE_24BIT_DIRECT 3
 #define TIM_PMODE_MIXED 4
 
-#define TIM_HEADER_FLAG_CF(flag)    ((u32)flag & 0x10)
+#define TIM_HEADER_FLAG_CF(flag)    ((u32)flag & 0x08)
 
 typedef struct __attribute((packed)) {
     u32 clutSectionSize; // includes header
@@ -58,83 +62,420 @@ typedef struct __attribute((packed)) {
     u8 data[0];
 } TimPixelHeader;
 
-void TimPreprocess(u8* timData) {
+// 5-bit channel to 8-bit, rounded to nearest (same as roundf(c * 255 / 31))
+#define TIM_EXPAND_CHANNEL(c) (((u32)(c) * 255 + 15) / 31)
+
+// 15-bit color (CLUT entry or direct pixel) to RGBA8888 (as little-endian u32); 0x0000 is transparent
+u32 _TimColor15ToRgba(u16 color) {
+    u32 r = TIM_EXPAND_CHANNEL(TIM_CLUT_ENTRY_R(color));
+    u32 g = TIM_EXPAND_CHANNEL(TIM_CLUT_ENTRY_G(color));
+    u32 b = TIM_EXPAND_CHANNEL(TIM_CLUT_ENTRY_B(color));
+
+    // u8 stp = TIM_CLUT_ENTRY_STP(color);
+
+    u32 a = 0xFFu;
+    if (color == 0x0000)
+        a = 0x00u;
+
+    return (a << 24) | (b << 16) | (g << 8) | r;
+}
+
+// Expand CLUT entries to RGBA8888
+void _TimExpandPalette(const u16* entries, u32 entryCount, u32* palette) {
+    for (unsigned i = 0; i < entryCount; i++)
+        palette[i] = _TimColor15ToRgba(entries[i]);
+}
+
+// Composite one decoded pixel over VRAM: opaque pixels are stored as a whole, transparent ones
+// leave VRAM as is, and only partially transparent ones are blended
+static inline void _TimVrPut(u32* dst, u32 rgba) {
+    u32 alpha = rgba >> 24;
+
+    if (alpha == 255)
+        *dst = rgba;
+    else if (alpha > 0) {
+        u8* srcPixel = (u8*)&rgba;
+        u8* dstPixel = (u8*)dst;
+
+        dstPixel[0] = (srcPixel[0] * alpha + dstPixel[0] * (255 - alpha)) / 255; // R
+        dstPixel[1] = (srcPixel[1] * alpha + dstPixel[1] * (255 - alpha)) / 255; // G
+        dstPixel[2] = (srcPixel[2] * alpha + dstPixel[2] * (255 - alpha)) / 255; // B
+        dstPixel[3] = dstPixel[3] > alpha ? dstPixel[3] : alpha;
+    }
+}
+
+// Decode 4-bit indexed pixels (two per byte, low nibble first) with a 16-color RGBA palette and
+// composite them over dst
+typedef void (*TimDecode4Func)(const u8* src, u32 byteCount, const u32* palette, u32* dst);
+
+// Decodes both pixels of a byte at once through a table of every byte value
+void _TimDecode4Scalar(const u8* src, u32 byteCount, const u32* palette, u32* dst) {
+    u32 pairs[256][2];
+    u8 pairOpaque[256];
+    for (unsigned i = 0; i < 256; i++) {
+        pairs[i][0] = palette[i & 0x0F];
+        pairs[i][1] = palette[i >> 4];
+
+        pairOpaque[i] = (pairs[i][0] >> 24) == 255 && (pairs[i][1] >> 24) == 255;
+    }
+
+    for (u32 i = 0; i < byteCount; i++) {
+        if (pairOpaque[src[i]])
+            memcpy(dst + i * 2, pairs[src[i]], sizeof(pairs[0]));
+        else {
+            _TimVrPut(dst + i * 2 + 0, pairs[src[i]][0]);
+            _TimVrPut(dst + i * 2 + 1, pairs[src[i]][1]);
+        }
+    }
+}
+
+#ifdef SIMD_X86
+// The palette is split into R, G, B and A byte planes so each one is a single pshufb lookup
+// of 16 indices; the planes are then interleaved back into RGBA pixels. Palette colors are
+// either opaque or fully transparent, so transparent pixels just keep what's under them.
+__attribute__((target("ssse3")))
+void _TimDecode4Ssse3(const u8* src, u32 byteCount, const u32* palette, u32* dst) {
+    u8 planes[4][16];
+    for (unsigned i = 0; i < 16; i++) {
+        planes[0][i] = palette[i] >> 0;
+        planes[1][i] = palette[i] >> 8;
+        planes[2][i] = palette[i] >> 16;
+        planes[3][i] = palette[i] >> 24;
+    }
+
+    __m128i planeR = _mm_loadu_si128((__m128i*)planes[0]);
+    __m128i planeG = _mm_loadu_si128((__m128i*)planes[1]);
+    __m128i planeB = _mm_loadu_si128((__m128i*)planes[2]);
+    __m128i planeA = _mm_loadu_si128((__m128i*)planes[3]);
+
+    __m128i nibbleMask = _mm_set1_epi8(0x0F);
+    __m128i alphaMask = _mm_set1_epi32(0xFF000000);
+    __m128i zero = _mm_setzero_si128();
+
+    u32 i = 0;
+    for (; i + 16 <= byteCount; i += 16) {
+        __m128i bytes = _mm_loadu_si128((__m128i*)(src + i));
+
+        __m128i low = _mm_and_si128(bytes, nibbleMask);
+        __m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), nibbleMask);
+
+        // Pixel order: low nibble of byte 0, high nibble of byte 0, low nibble of byte 1, ..
+        __m128i indexes[2] = { _mm_unpacklo_epi8(low, high), _mm_unpackhi_epi8(low, high) };
+
+        for (unsigned h = 0; h < 2; h++) {
+            __m128i r = _mm_shuffle_epi8(planeR, indexes[h]);
+            __m128i g = _mm_shuffle_epi8(planeG, indexes[h]);
+            __m128i b = _mm_shuffle_epi8(planeB, indexes[h]);
+            __m128i a = _mm_shuffle_epi8(planeA, indexes[h]);
+
+            __m128i rgLow = _mm_unpacklo_epi8(r, g);
+            __m128i rgHigh = _mm_unpackhi_epi8(r, g);
+            __m128i baLow = _mm_unpacklo_epi8(b, a);
+            __m128i baHigh = _mm_unpackhi_epi8(b, a);
+
+            __m128i pixels[4] = {
+                _mm_unpacklo_epi16(rgLow, baLow), _mm_unpackhi_epi16(rgLow, baLow),
+                _mm_unpacklo_epi16(rgHigh, baHigh), _mm_unpackhi_epi16(rgHigh, baHigh)
+            };
+
+            __m128i* out = (__m128i*)(dst + i * 2 + h * 16);
+            for (unsigned q = 0; q < 4; q++) {
+                __m128i transparent = _mm_cmpeq_epi32(_mm_and_si128(pixels[q], alphaMask), zero);
+
+                __m128i kept = _mm_and_si128(transparent, _mm_loadu_si128(out + q));
+                _mm_storeu_si128(out + q, _mm_or_si128(kept, _mm_andnot_si128(transparent, pixels[q])));
+            }
+        }
+    }
+
+    for (; i < byteCount; i++) {
+        _TimVrPut(dst + i * 2 + 0, palette[src[i] & 0x0F]);
+        _TimVrPut(dst + i * 2 + 1, palette[src[i] >> 4]);
+    }
+}
+#endif
+
+TimDecode4Func timDecode4 = NULL; // Picked by TimPreprocess
+
+TimDecode4Func _TimSelectDecode4(void) {
+#ifdef SIMD_X86
+    if (SimdHasSsse3())
+        return _TimDecode4Ssse3;
+#endif
+    return _TimDecode4Scalar;
+}
+
+// Decode a TIM's pixel data and composite it over the VRAM rectangle it covers, in the 4-bit
+// units of the VRAM image (width * 4 columns): 4-bit pixels are one column each, 8-bit ones two,
+// and 15-bit ones four. dst is the rectangle's first pixel, dstStride the VRAM width in pixels.
+typedef void (*TimDecodeFunc)(
+    const u8* src, u32 width, u32 height, const u32* palette, u32* dst, u32 dstStride
+);
+
+typedef struct {
+    u32 paletteSize; // 0 for direct color
+    TimDecodeFunc decode;
+} TimPixelMode;
+
+void _TimDecodeRows4(const u8* src, u32 width, u32 height, const u32* palette, u32* dst, u32 dstStride) {
+    for (u32 row = 0; row < height; row++)
+        timDecode4(src + row * width * 2, width * 2, palette, dst + row * dstStride);
+}
+
+void _TimDecodeRows8(const u8* src, u32 width, u32 height, const u32* palette, u32* dst, u32 dstStride) {
+    for (u32 row = 0; row < height; row++) {
+        const u8* srcRow = src + row * width * 2;
+        u32* dstRow = dst + row * dstStride;
+
+        for (u32 i = 0; i < width * 2; i++) {
+            u32 color = palette[srcRow[i]];
+
+            if ((color >> 24) == 255) {
+                dstRow[i * 2 + 0] = color;
+                dstRow[i * 2 + 1] = color;
+            }
+            else {
+                _TimVrPut(dstRow + i * 2 + 0, color);
+                _TimVrPut(dstRow + i * 2 + 1, color);
+            }
+        }
+    }
+}
+
+void _TimDecodeRows15(const u8* src, u32 width, u32 height, const u32* palette, u32* dst, u32 dstStride) {
+    for (u32 row = 0; row < height; row++) {
+        const u8* srcRow = src + row * width * 2;
+        u32* dstRow = dst + row * dstStride;
+
+        for (u32 i = 0; i < width; i++) {
+            u16 color;
+            memcpy(&color, srcRow + i * 2, sizeof(u16));
+
+            u32 rgba = _TimColor15ToRgba(color);
+            for (unsigned c = 0; c < 4; c++)
+                _TimVrPut(dstRow + i * 4 + c, rgba);
+        }
+    }
+}
+
+// 24-bit pixels take 1.5 VRAM words (six columns) each; a row's leftover bytes (if the row
+// isn't a whole number of pixels) are skipped. They are always opaque.
+void _TimDecodeRows24(const u8* src, u32 width, u32 height, const u32* palette, u32* dst, u32 dstStride) {
+    u32 rowBytes = width * 2;
+    u32 rowPixels = rowBytes / 3;
+
+    for (u32 row = 0; row < height; row++) {
+        const u8* srcRow = src + row * rowBytes;
+        u32* dstRow = dst + row * dstStride;
+
+        for (u32 i = 0; i < rowPixels; i++) {
+            const u8* pixel = srcRow + i * 3;
+            u32 rgba = 0xFF000000u | (pixel[2] << 16) | (pixel[1] << 8) | pixel[0];
+
+            for (unsigned c = 0; c < 6; c++)
+                dstRow[i * 6 + c] = rgba;
+        }
+    }
+}
+
+const TimPixelMode timPixelModes[4] = {
+    [TIM_PMODE_4BIT_CLUT]    = { 16,  _TimDecodeRows4 },
+    [TIM_PMODE_8BIT_CLUT]    = { 256, _TimDecodeRows8 },
+    [TIM_PMODE_15BIT_DIRECT] = { 0,   _TimDecodeRows15 },
+    [TIM_PMODE_24BIT_DIRECT] = { 0,   _TimDecodeRows24 }
+};
+
+const TimPixelMode* _TimGetPixelMode(TimFileHeader* fileHeader) {
+    u32 pmode = TIM_HEADER_FLAG_PMODE(fileHeader->flag);
+    if (pmode >= TIM_PMODE_MIXED)
+        panic("TIM pixel mode is unsupported");
+
+    return timPixelModes + pmode;
+}
+
+// NULL if the TIM has no CLUT section (CF flag clear)
+TimCLUTHeader* _TimGetClutHeader(TimFileHeader* fileHeader) {
+    if (!TIM_HEADER_FLAG_CF(fileHeader->flag))
+        return NULL;
+
+    return (TimCLUTHeader*)(fileHeader + 1);
+}
+
+TimPixelHeader* _TimGetPixelHeader(TimFileHeader* fileHeader) {
+    TimCLUTHeader* clutHeader = _TimGetClutHeader(fileHeader);
+    if (clutHeader == NULL)
+        return (TimPixelHeader*)(fileHeader + 1);
+
+    return (TimPixelHeader*)((u8*)clutHeader + clutHeader->clutSectionSize);
+}
+
+// Validates the header and both sections against the file size and the VRAM bounds
+void TimPreprocess(u8* timData, u64 timDataSize) {
+    if (timDataSize < sizeof(TimFileHeader))
+        panic("TIM file is too small");
+
     TimFileHeader* fileHeader = (TimFileHeader*)timData;
     if (fileHeader->id != TIM_HEADER_ID)
         panic("TIM file header ID is nonmatching");
     if (fileHeader->version != TIM_HEADER_VERSION)
         panic("TIM file header version is nonmatching");
-}
 
-void _TimDecodePixels(TimFileHeader* fileHeader, u32 paletteIndex, u32* pixels) {
-    TimCLUTHeader* clutHeader = (TimCLUTHeader*)(fileHeader + 1);
-    TimPixelHeader* pixelHeader = (TimPixelHeader*)((u8*)clutHeader + clutHeader->clutSectionSize);
+    _TimGetPixelMode(fileHeader);
 
-    u32 numPixels = pixelHeader->width * pixelHeader->height * 4;
+    u64 pixelOffset = sizeof(TimFileHeader);
 
-    u32 paletteOffset = paletteIndex * clutHeader->width;
-    for (unsigned i = 0; i < numPixels; ++i) {
-        u8 colorIndex = pixelHeader->data[i / 2];
-        if (i % 2)
-            colorIndex = ((colorIndex & 0xF0) >> 4);
-        else
-            colorIndex = colorIndex & 0x0F;
+    TimCLUTHeader* clutHeader = _TimGetClutHeader(fileHeader);
+    if (clutHeader) {
+        if (timDataSize - sizeof(TimFileHeader) < sizeof(TimCLUTHeader))
+            panic("TIM CLUT header is out of bounds");
 
-        u16 entry = clutHeader->entries[paletteOffset + colorIndex];
+        u64 clutSize = (u64)clutHeader->width * clutHeader->height * sizeof(u16);
+        if (
+            clutHeader->clutSectionSize < sizeof(TimCLUTHeader) + clutSize ||
+            clutHeader->clutSectionSize > timDataSize - sizeof(TimFileHeader)
+        )
+            panic("TIM CLUT section is out of bounds");
 
-        u8 raw_r = TIM_CLUT_ENTRY_R(entry);
-        u8 raw_g = TIM_CLUT_ENTRY_G(entry);
-        u8 raw_b = TIM_CLUT_ENTRY_B(entry);
-        u8 r = (u8)roundf(raw_r * 255.f / 31.f);
-        u8 g = (u8)roundf(raw_g * 255.f / 31.f);
-        u8 b = (u8)roundf(raw_b * 255.f / 31.f);
+        if (
+            clutHeader->fbX + clutHeader->width > VR_WIDTH ||
+            clutHeader->fbY + clutHeader->height > VR_HEIGHT
+        )
+            panic("TIM CLUT does not fit in VRAM");
+
+        pixelOffset += clutHeader->clutSectionSize;
+    }
 
-        // u8 stp = TIM_CLUT_ENTRY_STP(entry);
+    if (timDataSize - pixelOffset < sizeof(TimPixelHeader))
+        panic("TIM pixel header is out of bounds");
 
-        u8 a = 0xFFu;
-        if (entry == 0x0000)
-            a = 0x00u;
+    TimPixelHeader* pixelHeader = (TimPixelHeader*)(timData + pixelOffset);
+    u64 pixelSize = (u64)pixelHeader->width * pixelHeader->height * sizeof(u16);
+    if (timDataSize - pixelOffset - sizeof(TimPixelHeader) < pixelSize)
+        panic("TIM pixel data is out of bounds");
+
+    if (
+        pixelHeader->fbX + pixelHeader->width > VR_WIDTH ||
+        pixelHeader->fbY + pixelHeader->height > VR_HEIGHT
+    )
+        panic("TIM pixel data does not fit in VRAM");
+
+    if (timDecode4 == NULL)
+        timDecode4 = _TimSelectDecode4();
+}
 
-        pixels[i] = (a << 24) | (b << 16) | (g << 8) | r;
+// Indexed TIMs without a CLUT use one uploaded elsewhere in VRAM; lacking it, their
+// indexes are shown as a gray ramp
+void _TimBuildPalette(TimFileHeader* fileHeader, u32 paletteIndex, u32 paletteSize, u32* palette) {
+    TimCLUTHeader* clutHeader = _TimGetClutHeader(fileHeader);
+    if (clutHeader == NULL) {
+        for (unsigned i = 0; i < paletteSize; i++) {
+            u32 gray = i * 255 / (paletteSize - 1);
+            palette[i] = 0xFF000000u | (gray << 16) | (gray << 8) | gray;
+        }
+        return;
     }
+
+    // Colors missing from a short CLUT decode as transparent
+    memset(palette, 0, paletteSize * sizeof(u32));
+
+    u32 clutEntryCount = clutHeader->width * clutHeader->height;
+    u32 paletteOffset = paletteIndex * clutHeader->width;
+    if (paletteOffset < clutEntryCount)
+        _TimExpandPalette(clutHeader->entries + paletteOffset, MIN(clutEntryCount - paletteOffset, paletteSize), palette);
 }
 
-void TimVrCopy(u8* timData, u8* vr) {
+// Decode a TIM over its framebuffer rectangle: dst is the rectangle's first pixel (RGBA) and
+// dstStride the distance between its rows in pixels. Indexed TIMs use their first palette.
+void _TimDecodeRect(u8* timData, u32* dst, u32 dstStride) {
     TimFileHeader* fileHeader   = (TimFileHeader*)timData;
-    TimCLUTHeader* clutHeader   = (TimCLUTHeader*)(fileHeader + 1);
-    TimPixelHeader* pixelHeader = (TimPixelHeader*)((u8*)clutHeader + clutHeader->clutSectionSize);
+    TimPixelHeader* pixelHeader = _TimGetPixelHeader(fileHeader);
+
+    const TimPixelMode* mode = _TimGetPixelMode(fileHeader);
+
+    u32 palette[256];
+    if (mode->paletteSize)
+        _TimBuildPalette(fileHeader, 0, mode->paletteSize, palette);
 
-    u32 width = pixelHeader->width * 4;
-    u32 height = pixelHeader->height;
+    mode->decode(pixelHeader->data, pixelHeader->width, pixelHeader->height, palette, dst, dstStride);
+}
 
-    u8* imageData = malloc(width * height * 4);
-    _TimDecodePixels(fileHeader, 0, (u32*)imageData);
+// Decode a TIM straight into VRAM (RGBA, VR_WIDTH32 x VR_HEIGHT) at its framebuffer position
+void TimVrCopy(u8* timData, u8* vr) {
+    TimPixelHeader* pixelHeader = _TimGetPixelHeader((TimFileHeader*)timData);
 
-    for (unsigned row = 0; row < height; row++) {
-        u8* src = imageData + (row * width * 4);
-        u8* dst = vr + ((row + pixelHeader->fbY) * VR_WIDTH32 + (pixelHeader->fbX * 4)) * 4;
+    u32* dst = (u32*)vr + pixelHeader->fbY * VR_WIDTH32 + pixelHeader->fbX * 4;
+    _TimDecodeRect(timData, dst, VR_WIDTH32);
+}
 
-        for (unsigned col = 0; col < width; col++) {
-            u8* srcPixel = src + (col * 4);
-            u8* dstPixel = dst + (col * 4);
+typedef struct {
+    u8** timDatas;
+    u32** stagings; // Per TIM, its decoded rectangle over transparent black
+} _TimStagingJobs;
 
-            u8 alpha = srcPixel[3];
+void _TimDecodeStaging(void* user, u32 jobIndex) {
+    _TimStagingJobs* jobs = (_TimStagingJobs*)user;
 
-            // Overwrite the pixel
-            if (alpha == 255) {
-                *(u32*)dstPixel = *(u32*)srcPixel;
-            }
-            // Blend the pixel
-            else if (alpha > 0) {
-                dstPixel[0] = (srcPixel[0] * alpha + dstPixel[0] * (255 - alpha)) / 255; // R
-                dstPixel[1] = (srcPixel[1] * alpha + dstPixel[1] * (255 - alpha)) / 255; // G
-                dstPixel[2] = (srcPixel[2] * alpha + dstPixel[2] * (255 - alpha)) / 255; // B
-                dstPixel[3] = dstPixel[3] > alpha ? dstPixel[3] : alpha;
-            }
+    TimPixelHeader* pixelHeader = _TimGetPixelHeader((TimFileHeader*)jobs->timDatas[jobIndex]);
+    _TimDecodeRect(jobs->timDatas[jobIndex], jobs->stagings[jobIndex], pixelHeader->width * 4);
+}
+
+// Same as calling TimVrCopy on every TIM in order, but the TIMs are decoded concurrently into
+// staging buffers and only composited in order. Decoded pixels are either opaque or fully
+// transparent, so compositing a staged pixel gives exactly what decoding it in place would.
+void TimVrCopyMany(u8** timDatas, u32 timCount, u8* vr, u32 threadCount) {
+    if (threadCount <= 1 || timCount <= 1) {
+        for (u32 i = 0; i < timCount; i++)
+            TimVrCopy(timDatas[i], vr);
+        return;
+    }
+
+    _TimStagingJobs jobs;
+    jobs.timDatas = timDatas;
+    jobs.stagings = (u32**)CountedMalloc(timCount * sizeof(u32*));
+    for (u32 i = 0; i < timCount; i++) {
+        TimPixelHeader* pixelHeader = _TimGetPixelHeader((TimFileHeader*)timDatas[i]);
+        jobs.stagings[i] = (u32*)CountedCalloc((u64)pixelHeader->width * 4 * pixelHeader->height, sizeof(u32));
+    }
+
+    ThreadPoolRun(threadCount, timCount, _TimDecodeStaging, &jobs);
+
+    for (u32 i = 0; i < timCount; i++) {
+        TimPixelHeader* pixelHeader = _TimGetPixelHeader((TimFileHeader*)timDatas[i]);
+
+        u32 width = pixelHeader->width * 4;
+        for (u32 row = 0; row < pixelHeader->height; row++) {
+            const u32* src = jobs.stagings[i] + row * width;
+            u32* dst = (u32*)vr + (pixelHeader->fbY + row) * VR_WIDTH32 + pixelHeader->fbX * 4;
+
+            for (u32 col = 0; col < width; col++)
+                _TimVrPut(dst + col, src[col]);
         }
+
+        CountedFree(jobs.stagings[i]);
     }
+    CountedFree(jobs.stagings);
+}
+
+void _TimVrCopyRect16(const u8* src, u16 fbX, u16 fbY, u16 width, u16 height, u16* vr) {
+    for (unsigned row = 0; row < height; row++)
+        memcpy(vr + (fbY + row) * VR_WIDTH + fbX, src + row * width * sizeof(u16), width * sizeof(u16));
+}
+
+// Copy a TIM's CLUT and pixel data as-is into native VRAM (16-bit words, VR_WIDTH x VR_HEIGHT),
+// to be decoded when sampled
+void TimVrCopy16(u8* timData, u16* vr) {
+    TimFileHeader* fileHeader   = (TimFileHeader*)timData;
+    TimCLUTHeader* clutHeader   = _TimGetClutHeader(fileHeader);
+    TimPixelHeader* pixelHeader = _TimGetPixelHeader(fileHeader);
+
+    if (clutHeader)
+        _TimVrCopyRect16(
+            (u8*)clutHeader->entries, clutHeader->fbX, clutHeader->fbY, clutHeader->width, clutHeader->height, vr
+        );
 
-    free(imageData);
+    _TimVrCopyRect16(
+        pixelHeader->data, pixelHeader->fbX, pixelHeader->fbY, pixelHeader->width, pixelHeader->height, vr
+    );
 }
 
 #endif
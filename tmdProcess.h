@@ -6,6 +6,7 @@
 
 #include "timProcess.h"
 
+#include "allocStats.h"
 #include "common.h"
 
 #define TMD_HEADER_ID (0x00000041)
@@ -170,8 +171,8 @@ typedef struct __attribute((packed)) {
     u16 vI2; // vertex index for vertex 2
 } TmdTriangleGouraudTextured;
 
-#define CBA_GET_CBX(cba) (((u16)cba >> 10) & 0x3F) // upper 6 bits
-#define CBA_GET_CBY(cba) ((u16)cba & 0x1FF) // lower 9 bits
+#define CBA_GET_CBX(cba) ((u16)cba & 0x3F) // bits 0-5, in units of 16 halfwords
+#define CBA_GET_CBY(cba) (((u16)cba >> 6) & 0x1FF) // bits 6-14
 
 #define TSB_GET_TPAGE(tsb) ((u16)tsb & 0x1F) // bits 0-4
 #define TSB_GET_ABR(tsb) (((u16)tsb >> 5) & 0x3) // bits 5-6
@@ -202,6 +203,20 @@ typedef struct __attribute((packed)) {
     u16 _pad16_1;
 } TmdTriangleNonlitTextured;
 
+typedef struct __attribute((packed)) {
+    u8 rgb0[3]; // RGB color for vertex 0
+    u8 _mode; // duplicate of header mode
+
+    u8 rgb1[3]; // RGB color for vertex 1
+    u8 _pad8_0;
+
+    u8 rgb2[3]; // RGB color for vertex 2
+    u8 _pad8_1;
+
+    u16 vertexIndexes[3]; // indexes into vertex table
+    u16 _pad16;
+} TmdTriangleNonlitGouraud;
+
 typedef struct __attribute((packed)) {
     u8 uv0[2]; // UV coordinates for vertex 0
     u16 cba; // CLUT number [ CBA clutY * 64 + clutX / 16) ]
@@ -212,12 +227,205 @@ typedef struct __attribute((packed)) {
     u8 uv2[2]; // UV coordinates for vertex 2
     u16 _pad16_0;
 
-    u8 rgb[3]; // Base color for whole triangle
-    u8 _pad8;
+    u8 rgb0[3]; // Base color for vertex 0
+    u8 _pad8_0;
+
+    u8 rgb1[3]; // Base color for vertex 1
+    u8 _pad8_1;
+
+    u8 rgb2[3]; // Base color for vertex 2
+    u8 _pad8_2;
 
     u16 vertexIndexes[3]; // indexes into vertex table
     u16 _pad16_1;
-} TmdTriangleNonlitGouraud;
+} TmdTriangleNonlitGouraudTextured;
+
+// Quads (mode bit 3) are laid out like their triangle counterparts with a fourth vertex.
+// The vertices are in strip order, so the quad is made of triangles 0-1-2 and 1-3-2.
+
+typedef struct __attribute((packed)) {
+    u8 rgb[3]; // RGB color for whole quad
+    u8 _mode; // duplicate of mode
+
+    u16 normalIndex; // index into normal table
+    u16 vertexIndexes[4]; // indexes into vertex table
+    u16 _pad16;
+} TmdQuadFlat;
+
+typedef struct __attribute((packed)) {
+    u8 rgb0[3]; // RGB color for vertex 0
+    u8 _mode; // duplicate of header mode
+
+    u8 rgb1[3]; // RGB color for vertex 1
+    u8 _pad8_0;
+
+    u8 rgb2[3]; // RGB color for vertex 2
+    u8 _pad8_1;
+
+    u8 rgb3[3]; // RGB color for vertex 3
+    u8 _pad8_2;
+
+    u16 normalIndex; // index into normal table
+    u16 vertexIndexes[4]; // indexes into vertex table
+    u16 _pad16;
+} TmdQuadGradated;
+
+typedef struct __attribute((packed)) {
+    u8 uv0[2]; // UV coordinates for vertex 0
+    u16 cba; // CLUT number [ CBA clutY * 64 + clutX / 16) ]
+
+    u8 uv1[2]; // UV coordinates for vertex 1
+    u16 tsb; // Texture Page + Semitransparency Rate (0..3) << 5 + Colour Mode (0..2) << 7
+
+    u8 uv2[2]; // UV coordinates for vertex 2
+    u16 _pad16_0;
+
+    u8 uv3[2]; // UV coordinates for vertex 3
+    u16 _pad16_1;
+
+    u16 normalIndex; // index into normal table
+    u16 vertexIndexes[4]; // indexes into vertex table
+    u16 _pad16_2;
+} TmdQuadTextured;
+
+typedef struct __attribute((packed)) {
+    u8 rgb[3]; // RGB color for whole quad
+    u8 _mode; // duplicate of mode
+
+    u16 nI0; // normal index for vertex 0
+    u16 vI0; // vertex index for vertex 0
+
+    u16 nI1; // normal index for vertex 1
+    u16 vI1; // vertex index for vertex 1
+
+    u16 nI2; // normal index for vertex 2
+    u16 vI2; // vertex index for vertex 2
+
+    u16 nI3; // normal index for vertex 3
+    u16 vI3; // vertex index for vertex 3
+} TmdQuadGouraud;
+
+typedef struct __attribute((packed)) {
+    u8 rgb0[3]; // RGB color for vertex 0
+    u8 _mode; // duplicate of header mode
+
+    u8 rgb1[3]; // RGB color for vertex 1
+    u8 _pad8_0;
+
+    u8 rgb2[3]; // RGB color for vertex 2
+    u8 _pad8_1;
+
+    u8 rgb3[3]; // RGB color for vertex 3
+    u8 _pad8_2;
+
+    u16 nI0; // normal index for vertex 0
+    u16 vI0; // vertex index for vertex 0
+
+    u16 nI1; // normal index for vertex 1
+    u16 vI1; // vertex index for vertex 1
+
+    u16 nI2; // normal index for vertex 2
+    u16 vI2; // vertex index for vertex 2
+
+    u16 nI3; // normal index for vertex 3
+    u16 vI3; // vertex index for vertex 3
+} TmdQuadGouraudGradated;
+
+typedef struct __attribute((packed)) {
+    u8 uv0[2]; // UV coordinates for vertex 0
+    u16 cba; // position of CLUT in VRAM (use CBA_GET_CBX and CBA_GET_CBY)
+
+    u8 uv1[2]; // UV coordinates for vertex 1
+    u16 tsb; // Texture Page + Semitransparency Rate (0..3) << 5 + Colour Mode (0..2) << 7
+
+    u8 uv2[2]; // UV coordinates for vertex 2
+    u16 _pad16_0;
+
+    u8 uv3[2]; // UV coordinates for vertex 3
+    u16 _pad16_1;
+
+    u16 nI0; // normal index for vertex 0
+    u16 vI0; // vertex index for vertex 0
+
+    u16 nI1; // normal index for vertex 1
+    u16 vI1; // vertex index for vertex 1
+
+    u16 nI2; // normal index for vertex 2
+    u16 vI2; // vertex index for vertex 2
+
+    u16 nI3; // normal index for vertex 3
+    u16 vI3; // vertex index for vertex 3
+} TmdQuadGouraudTextured;
+
+typedef struct __attribute((packed)) {
+    u8 rgb[3]; // RGB color for whole quad
+    u8 _mode; // duplicate of mode
+
+    u16 vertexIndexes[4]; // indexes into vertex table
+} TmdQuadNonlit;
+
+typedef struct __attribute((packed)) {
+    u8 rgb0[3]; // RGB color for vertex 0
+    u8 _mode; // duplicate of header mode
+
+    u8 rgb1[3]; // RGB color for vertex 1
+    u8 _pad8_0;
+
+    u8 rgb2[3]; // RGB color for vertex 2
+    u8 _pad8_1;
+
+    u8 rgb3[3]; // RGB color for vertex 3
+    u8 _pad8_2;
+
+    u16 vertexIndexes[4]; // indexes into vertex table
+} TmdQuadNonlitGouraud;
+
+typedef struct __attribute((packed)) {
+    u8 uv0[2]; // UV coordinates for vertex 0
+    u16 cba; // CLUT number [ CBA clutY * 64 + clutX / 16) ]
+
+    u8 uv1[2]; // UV coordinates for vertex 1
+    u16 tsb; // Texture Page + Semitransparency Rate (0..3) << 5 + Colour Mode (0..2) << 7
+
+    u8 uv2[2]; // UV coordinates for vertex 2
+    u16 _pad16_0;
+
+    u8 uv3[2]; // UV coordinates for vertex 3
+    u16 _pad16_1;
+
+    u8 rgb[3]; // Base color for whole quad
+    u8 _pad8;
+
+    u16 vertexIndexes[4]; // indexes into vertex table
+} TmdQuadNonlitTextured;
+
+typedef struct __attribute((packed)) {
+    u8 uv0[2]; // UV coordinates for vertex 0
+    u16 cba; // CLUT number [ CBA clutY * 64 + clutX / 16) ]
+
+    u8 uv1[2]; // UV coordinates for vertex 1
+    u16 tsb; // Texture Page + Semitransparency Rate (0..3) << 5 + Colour Mode (0..2) << 7
+
+    u8 uv2[2]; // UV coordinates for vertex 2
+    u16 _pad16_0;
+
+    u8 uv3[2]; // UV coordinates for vertex 3
+    u16 _pad16_1;
+
+    u8 rgb0[3]; // Base color for vertex 0
+    u8 _pad8_0;
+
+    u8 rgb1[3]; // Base color for vertex 1
+    u8 _pad8_1;
+
+    u8 rgb2[3]; // Base color for vertex 2
+    u8 _pad8_2;
+
+    u8 rgb3[3]; // Base color for vertex 3
+    u8 _pad8_3;
+
+    u16 vertexIndexes[4]; // indexes into vertex table
+} TmdQuadNonlitGouraudTextured;
 
 typedef struct __attribute((packed)) {
     u8 rgb[3]; // RGB color for whole line
@@ -236,31 +444,6 @@ typedef struct __attribute((packed)) {
     u16 vertexIndexes[2]; // indexes into vertex table
 } TmdLineGradated;
 
-#define HASH_PRIMITIVE_ATTRIBS(flag, mode) ((u32)(flag) ^ ((((u32)(mode)) << 16) | (((u32)(mode)) >> 16)))
-
-typedef struct __attribute__((packed)) {
-    struct __attribute__((packed)) {
-        u8 isLine : 1;
-        u8 isFlat : 1;
-        u8 isNonlit : 1;
-        u8 isGradated : 1;
-        u8 isGouraud : 1;
-        u8 isTextured : 1;
-        u8 OK : 1; // Did it get loaded in properly?
-        u8 reserved : 1;
-    } flags;
-
-    u8 rgb0[3];
-    u8 rgb1[3];
-    u8 rgb2[3];
-    u16 uv0[2];
-    u16 uv1[2];
-    u16 uv2[2];
-    u16 tsb;
-    s16 vertices[3][3];
-    float normals[3][3];
-} WorkPrimitive;
-
 typedef struct __attribute((packed)) {
     u8 rgb[3]; // RGB color for whole line
     u8 _pad8;
@@ -268,10 +451,61 @@ typedef struct __attribute((packed)) {
     u16 vertexIndexes[2]; // indexes into vertex table
 } ProLine;
 
-void TmdPreprocess(u8* tmdData) {
+// Check that a table of (count * stride) bytes at offset lies within the file
+int _TmdRangeInBounds(u64 offset, u64 count, u64 stride, u64 tmdDataSize) {
+    return offset <= tmdDataSize && count * stride <= tmdDataSize - offset;
+}
+
+// Validates the file header, the object table and every object's vertex, normal and primitive
+// tables against the file size. Returns what is wrong with the TMD, or NULL if nothing is, in
+// which case the rest of the module can index into tmdData freely.
+const char* TmdValidate(u8* tmdData, u64 tmdDataSize) {
+    if (tmdDataSize < sizeof(TmdFileHeader))
+        return "TMD file is too small";
+
     TmdFileHeader* fileHeader = (TmdFileHeader*)tmdData;
     if (fileHeader->id != TMD_HEADER_ID)
-        panic("TMD file header ID is nonmatching");
+        return "TMD file header ID is nonmatching";
+
+    if (!_TmdRangeInBounds(sizeof(TmdFileHeader), fileHeader->objectCount, sizeof(TmdObjectHeader), tmdDataSize))
+        return "TMD object table is out of bounds";
+
+    for (unsigned i = 0; i < fileHeader->objectCount; i++) {
+        TmdObjectHeader* objectHeader = GET_TMD_OBJECT_HEADER(tmdData, i);
+
+        if (!_TmdRangeInBounds(
+            sizeof(TmdFileHeader) + (u64)objectHeader->verticesOffset,
+            objectHeader->vertexCount, sizeof(TmdVertex), tmdDataSize
+        ))
+            return "TMD object vertex table is out of bounds";
+        if (!_TmdRangeInBounds(
+            sizeof(TmdFileHeader) + (u64)objectHeader->normalsOffset,
+            objectHeader->normalCount, sizeof(TmdNormal), tmdDataSize
+        ))
+            return "TMD object normal table is out of bounds";
+
+        u64 primitiveOffset = sizeof(TmdFileHeader) + (u64)objectHeader->primitivesOffset;
+        for (unsigned j = 0; j < objectHeader->primitiveCount; j++) {
+            if (!_TmdRangeInBounds(primitiveOffset, 1, sizeof(TmdPrimitiveHeader), tmdDataSize))
+                return "TMD primitive header is out of bounds";
+
+            TmdPrimitiveHeader* primitiveHeader = (TmdPrimitiveHeader*)(tmdData + primitiveOffset);
+            primitiveOffset += sizeof(TmdPrimitiveHeader);
+
+            if (!_TmdRangeInBounds(primitiveOffset, primitiveHeader->ilen, 4, tmdDataSize))
+                return "TMD primitive packet is out of bounds";
+
+            primitiveOffset += primitiveHeader->ilen * 4;
+        }
+    }
+
+    return NULL;
+}
+
+void TmdPreprocess(u8* tmdData, u64 tmdDataSize) {
+    const char* error = TmdValidate(tmdData, tmdDataSize);
+    if (error)
+        panic(error);
 }
 
 u32 TmdGetObjectCount(u8* tmdData) {
@@ -312,182 +546,564 @@ float TmdObjectGetScale(u8* tmdData, u32 objectIndex) {
     return powf(2.f, (float)objectHeader->scale);
 }
 
-WorkPrimitive* TmdObjectCreateWorkPrimitives(u8* tmdData, u32 objectIndex) {
-    TmdObjectHeader* objectHeader = GET_TMD_OBJECT_HEADER(tmdData, objectIndex);
+// Primitive header mode bits
+#define TMD_MODE_TME (0x04) // Textured
+#define TMD_MODE_QUAD (0x08) // 4 vertices instead of 3
+#define TMD_MODE_IIP (0x10) // Gouraud shaded
+#define TMD_MODE_CODE(mode) (((u8)(mode) >> 5) & 0x7) // TMD_CODE_*
+
+#define TMD_CODE_POLYGON (1)
+#define TMD_CODE_LINE (2)
+
+// Primitive header flag bits
+#define TMD_FLAG_LGT (0x01) // Light source calculation off
+#define TMD_FLAG_GRD (0x04) // Gradation (one color per vertex)
+
+// Index into tmdPrimitiveTypes. Only the bits that change the packet layout are kept:
+// flag LGT & GRD and mode CODE, IIP, QUAD & TME. Semitransparency (ABE), brightness (TGE)
+// and double-sided (FCE) don't affect how a packet is decoded.
+#define TMD_PRIM_TYPE_INDEX(flag, mode) ( \
+    (((u32)(mode) >> 2) & 0x3F) | (((u32)(flag) & TMD_FLAG_LGT) << 6) | (((u32)(flag) & TMD_FLAG_GRD) << 5) \
+)
+
+// Attribute mask of a primitive type
+#define TMD_PRIM_ATTRIB_LINE (1 << 0)
+#define TMD_PRIM_ATTRIB_NONLIT (1 << 1)
+#define TMD_PRIM_ATTRIB_GRADATED (1 << 2) // Color per vertex
+#define TMD_PRIM_ATTRIB_GOURAUD (1 << 3) // Normal per vertex
+#define TMD_PRIM_ATTRIB_TEXTURED (1 << 4)
+
+// Decoded triangles & lines of an object as one array per attribute, so decoding and mesh
+// building only stream through what they use. Vertices and normals stay indexes into the
+// object's tables. Lines repeat their end as the third corner.
+typedef struct {
+    u32 count;
+
+    u16 (*vertexIndexes)[3];
+    u16 (*normalIndexes)[3]; // 0 for nonlit primitives
+    u16 (*uvs)[3][2]; // In VRAM columns/rows; textured primitives only
+    u16* tsbs;
+    u16* cbas;
+    u8 (*colors)[3][3]; // RGB; untextured primitives only
+    u8* attribs; // TMD_PRIM_ATTRIB_*
+} WorkPrimitives;
+
+#define _WORK_PRIMITIVE_SIZE (6 + 6 + 12 + 2 + 2 + 9 + 1)
+
+// Bytes of storage for WorkPrimitivesInit
+u64 WorkPrimitivesGetSize(u32 capacity) {
+    return (u64)capacity * _WORK_PRIMITIVE_SIZE;
+}
 
-    TmdVertex* vertices = (TmdVertex*)(tmdData + sizeof(TmdFileHeader) + objectHeader->verticesOffset);
-    TmdNormal* normals = (TmdNormal*)(tmdData + sizeof(TmdFileHeader) + objectHeader->normalsOffset);
+// Lay the arrays out in memory of WorkPrimitivesGetSize(capacity) bytes, 16-bit ones first so
+// they stay aligned
+WorkPrimitives WorkPrimitivesInit(void* memory, u32 capacity) {
+    WorkPrimitives workPrimitives;
+    workPrimitives.count = 0;
+
+    u8* next = (u8*)memory;
+    workPrimitives.vertexIndexes = (u16(*)[3])next;
+    next += capacity * sizeof(u16[3]);
+    workPrimitives.normalIndexes = (u16(*)[3])next;
+    next += capacity * sizeof(u16[3]);
+    workPrimitives.uvs = (u16(*)[3][2])next;
+    next += capacity * sizeof(u16[3][2]);
+    workPrimitives.tsbs = (u16*)next;
+    next += capacity * sizeof(u16);
+    workPrimitives.cbas = (u16*)next;
+    next += capacity * sizeof(u16);
+    workPrimitives.colors = (u8(*)[3][3])next;
+    next += capacity * sizeof(u8[3][3]);
+    workPrimitives.attribs = next;
 
-    WorkPrimitive* workPrimitives = (WorkPrimitive*)calloc(objectHeader->primitiveCount, sizeof(WorkPrimitive));
+    return workPrimitives;
+}
 
-    TmdPrimitiveHeader* primitiveHeader =
-        (TmdPrimitiveHeader*)(tmdData + sizeof(TmdFileHeader) + objectHeader->primitivesOffset);
-    for (unsigned i = 0; i < objectHeader->primitiveCount; i++) {
-        void* currentPrimitiveData = (void*)(primitiveHeader + 1);
+// Per-vertex references of a primitive packet, gathered by a type's decode routine
+typedef struct {
+    u16 vertexIndexes[4];
+    u16 normalIndexes[4];
+    u8* rgb[4];
+    u8* uv[4];
+
+    u16 cba;
+    u16 tsb;
+} TmdPrimitiveCorners;
+
+typedef void (*TmdPrimitiveGatherFunc)(void* packet, TmdPrimitiveCorners* corners);
+
+typedef struct {
+    u8 ilen; // Packet length in words (stride after the primitive header)
+    u8 vertexCount; // 2 (line), 3 (triangle) or 4 (quad)
+    u8 attribs; // TMD_PRIM_ATTRIB_*
 
-        int isPolygon = IS_PRIM_POLYGON(primitiveHeader);
+    TmdPrimitiveGatherFunc gather; // NULL if the type is not supported
+} TmdPrimitiveType;
 
-        WorkPrimitive* workPrimitive = workPrimitives + i;
-        workPrimitive->flags.isLine = !isPolygon;
+// Write 3 entries of the same value
+#define _TMD_CORNERS_FILL3(array, value) \
+    do { (array)[0] = (array)[1] = (array)[2] = (value); } while (0)
+#define _TMD_CORNERS_FILL4(array, value) \
+    do { (array)[0] = (array)[1] = (array)[2] = (array)[3] = (value); } while (0)
 
-        switch (HASH_PRIMITIVE_ATTRIBS(primitiveHeader->flag, primitiveHeader->mode)) {
-        case HASH_PRIMITIVE_ATTRIBS(0, 0x20): {
-            TmdTriangleFlat* tri = (TmdTriangleFlat*)currentPrimitiveData;
+void _TmdGatherTriangleFlat(void* packet, TmdPrimitiveCorners* corners) {
+    TmdTriangleFlat* tri = (TmdTriangleFlat*)packet;
 
-            TmdVertex* v0 = vertices + tri->vertexIndexes[0];
-            TmdVertex* v1 = vertices + tri->vertexIndexes[1];
-            TmdVertex* v2 = vertices + tri->vertexIndexes[2];
+    memcpy(corners->vertexIndexes, tri->vertexIndexes, sizeof(u16) * 3);
+    _TMD_CORNERS_FILL3(corners->normalIndexes, tri->normalIndex);
+    _TMD_CORNERS_FILL3(corners->rgb, tri->rgb);
+}
+
+void _TmdGatherTriangleGradated(void* packet, TmdPrimitiveCorners* corners) {
+    TmdTriangleGradated* tri = (TmdTriangleGradated*)packet;
+
+    memcpy(corners->vertexIndexes, tri->vertexIndexes, sizeof(u16) * 3);
+    _TMD_CORNERS_FILL3(corners->normalIndexes, tri->normalIndex);
+    corners->rgb[0] = tri->rgb0;
+    corners->rgb[1] = tri->rgb1;
+    corners->rgb[2] = tri->rgb2;
+}
+
+void _TmdGatherTriangleTextured(void* packet, TmdPrimitiveCorners* corners) {
+    TmdTriangleTextured* tri = (TmdTriangleTextured*)packet;
+
+    memcpy(corners->vertexIndexes, tri->vertexIndexes, sizeof(u16) * 3);
+    _TMD_CORNERS_FILL3(corners->normalIndexes, tri->normalIndex);
+    corners->uv[0] = tri->uv0;
+    corners->uv[1] = tri->uv1;
+    corners->uv[2] = tri->uv2;
+    corners->cba = tri->cba;
+    corners->tsb = tri->tsb;
+}
+
+void _TmdGatherTriangleGouraud(void* packet, TmdPrimitiveCorners* corners) {
+    TmdTriangleGouraud* tri = (TmdTriangleGouraud*)packet;
+
+    corners->vertexIndexes[0] = tri->vI0;
+    corners->vertexIndexes[1] = tri->vI1;
+    corners->vertexIndexes[2] = tri->vI2;
+    corners->normalIndexes[0] = tri->nI0;
+    corners->normalIndexes[1] = tri->nI1;
+    corners->normalIndexes[2] = tri->nI2;
+    _TMD_CORNERS_FILL3(corners->rgb, tri->rgb);
+}
+
+void _TmdGatherTriangleGouraudGradated(void* packet, TmdPrimitiveCorners* corners) {
+    TmdTriangleGouraudGradated* tri = (TmdTriangleGouraudGradated*)packet;
+
+    corners->vertexIndexes[0] = tri->vI0;
+    corners->vertexIndexes[1] = tri->vI1;
+    corners->vertexIndexes[2] = tri->vI2;
+    corners->normalIndexes[0] = tri->nI0;
+    corners->normalIndexes[1] = tri->nI1;
+    corners->normalIndexes[2] = tri->nI2;
+    corners->rgb[0] = tri->rgb0;
+    corners->rgb[1] = tri->rgb1;
+    corners->rgb[2] = tri->rgb2;
+}
+
+void _TmdGatherTriangleGouraudTextured(void* packet, TmdPrimitiveCorners* corners) {
+    TmdTriangleGouraudTextured* tri = (TmdTriangleGouraudTextured*)packet;
+
+    corners->vertexIndexes[0] = tri->vI0;
+    corners->vertexIndexes[1] = tri->vI1;
+    corners->vertexIndexes[2] = tri->vI2;
+    corners->normalIndexes[0] = tri->nI0;
+    corners->normalIndexes[1] = tri->nI1;
+    corners->normalIndexes[2] = tri->nI2;
+    corners->uv[0] = tri->uv0;
+    corners->uv[1] = tri->uv1;
+    corners->uv[2] = tri->uv2;
+    corners->cba = tri->cba;
+    corners->tsb = tri->tsb;
+}
+
+void _TmdGatherTriangleNonlit(void* packet, TmdPrimitiveCorners* corners) {
+    TmdTriangleNonlit* tri = (TmdTriangleNonlit*)packet;
+
+    memcpy(corners->vertexIndexes, tri->vertexIndexes, sizeof(u16) * 3);
+    _TMD_CORNERS_FILL3(corners->rgb, tri->rgb);
+}
+
+void _TmdGatherTriangleNonlitGouraud(void* packet, TmdPrimitiveCorners* corners) {
+    TmdTriangleNonlitGouraud* tri = (TmdTriangleNonlitGouraud*)packet;
+
+    memcpy(corners->vertexIndexes, tri->vertexIndexes, sizeof(u16) * 3);
+    corners->rgb[0] = tri->rgb0;
+    corners->rgb[1] = tri->rgb1;
+    corners->rgb[2] = tri->rgb2;
+}
+
+void _TmdGatherTriangleNonlitTextured(void* packet, TmdPrimitiveCorners* corners) {
+    TmdTriangleNonlitTextured* tri = (TmdTriangleNonlitTextured*)packet;
+
+    memcpy(corners->vertexIndexes, tri->vertexIndexes, sizeof(u16) * 3);
+    _TMD_CORNERS_FILL3(corners->rgb, tri->rgb);
+    corners->uv[0] = tri->uv0;
+    corners->uv[1] = tri->uv1;
+    corners->uv[2] = tri->uv2;
+    corners->cba = tri->cba;
+    corners->tsb = tri->tsb;
+}
+
+void _TmdGatherTriangleNonlitGouraudTextured(void* packet, TmdPrimitiveCorners* corners) {
+    TmdTriangleNonlitGouraudTextured* tri = (TmdTriangleNonlitGouraudTextured*)packet;
+
+    memcpy(corners->vertexIndexes, tri->vertexIndexes, sizeof(u16) * 3);
+    corners->rgb[0] = tri->rgb0;
+    corners->rgb[1] = tri->rgb1;
+    corners->rgb[2] = tri->rgb2;
+    corners->uv[0] = tri->uv0;
+    corners->uv[1] = tri->uv1;
+    corners->uv[2] = tri->uv2;
+    corners->cba = tri->cba;
+    corners->tsb = tri->tsb;
+}
+
+void _TmdGatherQuadFlat(void* packet, TmdPrimitiveCorners* corners) {
+    TmdQuadFlat* quad = (TmdQuadFlat*)packet;
+
+    memcpy(corners->vertexIndexes, quad->vertexIndexes, sizeof(u16) * 4);
+    _TMD_CORNERS_FILL4(corners->normalIndexes, quad->normalIndex);
+    _TMD_CORNERS_FILL4(corners->rgb, quad->rgb);
+}
 
-            workPrimitive->flags.isFlat = 1;
-            workPrimitive->flags.isNonlit = 0;
-            workPrimitive->flags.isGradated = 0;
-            workPrimitive->flags.isGouraud = 0;
-            workPrimitive->flags.isTextured = 0;
+void _TmdGatherQuadGradated(void* packet, TmdPrimitiveCorners* corners) {
+    TmdQuadGradated* quad = (TmdQuadGradated*)packet;
+
+    memcpy(corners->vertexIndexes, quad->vertexIndexes, sizeof(u16) * 4);
+    _TMD_CORNERS_FILL4(corners->normalIndexes, quad->normalIndex);
+    corners->rgb[0] = quad->rgb0;
+    corners->rgb[1] = quad->rgb1;
+    corners->rgb[2] = quad->rgb2;
+    corners->rgb[3] = quad->rgb3;
+}
+
+void _TmdGatherQuadTextured(void* packet, TmdPrimitiveCorners* corners) {
+    TmdQuadTextured* quad = (TmdQuadTextured*)packet;
+
+    memcpy(corners->vertexIndexes, quad->vertexIndexes, sizeof(u16) * 4);
+    _TMD_CORNERS_FILL4(corners->normalIndexes, quad->normalIndex);
+    corners->uv[0] = quad->uv0;
+    corners->uv[1] = quad->uv1;
+    corners->uv[2] = quad->uv2;
+    corners->uv[3] = quad->uv3;
+    corners->cba = quad->cba;
+    corners->tsb = quad->tsb;
+}
 
-            memcpy(workPrimitive->rgb0, tri->rgb, 3);
-            memcpy(workPrimitive->rgb1, tri->rgb, 3);
-            memcpy(workPrimitive->rgb2, tri->rgb, 3);
+void _TmdGatherQuadGouraud(void* packet, TmdPrimitiveCorners* corners) {
+    TmdQuadGouraud* quad = (TmdQuadGouraud*)packet;
+
+    corners->vertexIndexes[0] = quad->vI0;
+    corners->vertexIndexes[1] = quad->vI1;
+    corners->vertexIndexes[2] = quad->vI2;
+    corners->vertexIndexes[3] = quad->vI3;
+    corners->normalIndexes[0] = quad->nI0;
+    corners->normalIndexes[1] = quad->nI1;
+    corners->normalIndexes[2] = quad->nI2;
+    corners->normalIndexes[3] = quad->nI3;
+    _TMD_CORNERS_FILL4(corners->rgb, quad->rgb);
+}
 
-            memcpy(workPrimitive->vertices[0], v0, sizeof(TmdVertex));
-            memcpy(workPrimitive->vertices[1], v1, sizeof(TmdVertex));
-            memcpy(workPrimitive->vertices[2], v2, sizeof(TmdVertex));
+void _TmdGatherQuadGouraudGradated(void* packet, TmdPrimitiveCorners* corners) {
+    TmdQuadGouraudGradated* quad = (TmdQuadGouraudGradated*)packet;
+
+    corners->vertexIndexes[0] = quad->vI0;
+    corners->vertexIndexes[1] = quad->vI1;
+    corners->vertexIndexes[2] = quad->vI2;
+    corners->vertexIndexes[3] = quad->vI3;
+    corners->normalIndexes[0] = quad->nI0;
+    corners->normalIndexes[1] = quad->nI1;
+    corners->normalIndexes[2] = quad->nI2;
+    corners->normalIndexes[3] = quad->nI3;
+    corners->rgb[0] = quad->rgb0;
+    corners->rgb[1] = quad->rgb1;
+    corners->rgb[2] = quad->rgb2;
+    corners->rgb[3] = quad->rgb3;
+}
 
-            memset(workPrimitive->normals, 0, sizeof(float) * 3 * 3);
+void _TmdGatherQuadGouraudTextured(void* packet, TmdPrimitiveCorners* corners) {
+    TmdQuadGouraudTextured* quad = (TmdQuadGouraudTextured*)packet;
+
+    corners->vertexIndexes[0] = quad->vI0;
+    corners->vertexIndexes[1] = quad->vI1;
+    corners->vertexIndexes[2] = quad->vI2;
+    corners->vertexIndexes[3] = quad->vI3;
+    corners->normalIndexes[0] = quad->nI0;
+    corners->normalIndexes[1] = quad->nI1;
+    corners->normalIndexes[2] = quad->nI2;
+    corners->normalIndexes[3] = quad->nI3;
+    corners->uv[0] = quad->uv0;
+    corners->uv[1] = quad->uv1;
+    corners->uv[2] = quad->uv2;
+    corners->uv[3] = quad->uv3;
+    corners->cba = quad->cba;
+    corners->tsb = quad->tsb;
+}
 
-            workPrimitive->flags.OK = 1;
-        } break;
+void _TmdGatherQuadNonlit(void* packet, TmdPrimitiveCorners* corners) {
+    TmdQuadNonlit* quad = (TmdQuadNonlit*)packet;
 
-        case HASH_PRIMITIVE_ATTRIBS(0, 0x30): {
-            TmdTriangleGouraud* tri = (TmdTriangleGouraud*)currentPrimitiveData;
+    memcpy(corners->vertexIndexes, quad->vertexIndexes, sizeof(u16) * 4);
+    _TMD_CORNERS_FILL4(corners->rgb, quad->rgb);
+}
 
-            TmdVertex* v0 = vertices + tri->vI0;
-            TmdVertex* v1 = vertices + tri->vI1;
-            TmdVertex* v2 = vertices + tri->vI2;
+void _TmdGatherQuadNonlitGouraud(void* packet, TmdPrimitiveCorners* corners) {
+    TmdQuadNonlitGouraud* quad = (TmdQuadNonlitGouraud*)packet;
 
-            WorkNormal n0 = TmdNormalToWorkNormal(normals + tri->nI0);
-            WorkNormal n1 = TmdNormalToWorkNormal(normals + tri->nI1);
-            WorkNormal n2 = TmdNormalToWorkNormal(normals + tri->nI2);
+    memcpy(corners->vertexIndexes, quad->vertexIndexes, sizeof(u16) * 4);
+    corners->rgb[0] = quad->rgb0;
+    corners->rgb[1] = quad->rgb1;
+    corners->rgb[2] = quad->rgb2;
+    corners->rgb[3] = quad->rgb3;
+}
 
-            workPrimitive->flags.isFlat = 0;
-            workPrimitive->flags.isNonlit = 0;
-            workPrimitive->flags.isGradated = 0;
-            workPrimitive->flags.isGouraud = 1;
-            workPrimitive->flags.isTextured = 0;
+void _TmdGatherQuadNonlitTextured(void* packet, TmdPrimitiveCorners* corners) {
+    TmdQuadNonlitTextured* quad = (TmdQuadNonlitTextured*)packet;
+
+    memcpy(corners->vertexIndexes, quad->vertexIndexes, sizeof(u16) * 4);
+    _TMD_CORNERS_FILL4(corners->rgb, quad->rgb);
+    corners->uv[0] = quad->uv0;
+    corners->uv[1] = quad->uv1;
+    corners->uv[2] = quad->uv2;
+    corners->uv[3] = quad->uv3;
+    corners->cba = quad->cba;
+    corners->tsb = quad->tsb;
+}
 
-            memcpy(workPrimitive->rgb0, tri->rgb, 3);
-            memcpy(workPrimitive->rgb1, tri->rgb, 3);
-            memcpy(workPrimitive->rgb2, tri->rgb, 3);
+void _TmdGatherQuadNonlitGouraudTextured(void* packet, TmdPrimitiveCorners* corners) {
+    TmdQuadNonlitGouraudTextured* quad = (TmdQuadNonlitGouraudTextured*)packet;
+
+    memcpy(corners->vertexIndexes, quad->vertexIndexes, sizeof(u16) * 4);
+    corners->rgb[0] = quad->rgb0;
+    corners->rgb[1] = quad->rgb1;
+    corners->rgb[2] = quad->rgb2;
+    corners->rgb[3] = quad->rgb3;
+    corners->uv[0] = quad->uv0;
+    corners->uv[1] = quad->uv1;
+    corners->uv[2] = quad->uv2;
+    corners->uv[3] = quad->uv3;
+    corners->cba = quad->cba;
+    corners->tsb = quad->tsb;
+}
 
-            memcpy(workPrimitive->vertices[0], v0, sizeof(TmdVertex));
-            memcpy(workPrimitive->vertices[1], v1, sizeof(TmdVertex));
-            memcpy(workPrimitive->vertices[2], v2, sizeof(TmdVertex));
+void _TmdGatherLineFlat(void* packet, TmdPrimitiveCorners* corners) {
+    TmdLineFlat* line = (TmdLineFlat*)packet;
 
-            memcpy(workPrimitive->normals[0], &n0, sizeof(WorkNormal));
-            memcpy(workPrimitive->normals[1], &n1, sizeof(WorkNormal));
-            memcpy(workPrimitive->normals[2], &n2, sizeof(WorkNormal));
+    memcpy(corners->vertexIndexes, line->vertexIndexes, sizeof(u16) * 2);
+    corners->rgb[0] = corners->rgb[1] = line->rgb;
+}
 
-            workPrimitive->flags.OK = 1;
-        } break;
-        
-        case HASH_PRIMITIVE_ATTRIBS(0, 0x40):
-        case HASH_PRIMITIVE_ATTRIBS(1, 0x40): {
-            TmdLineFlat* line = (TmdLineFlat*)currentPrimitiveData;
+void _TmdGatherLineGradated(void* packet, TmdPrimitiveCorners* corners) {
+    TmdLineGradated* line = (TmdLineGradated*)packet;
 
-            TmdVertex* v0 = vertices + line->vertexIndexes[0];
-            TmdVertex* v1 = vertices + line->vertexIndexes[1];
+    memcpy(corners->vertexIndexes, line->vertexIndexes, sizeof(u16) * 2);
+    corners->rgb[0] = line->rgb0;
+    corners->rgb[1] = line->rgb1;
+}
 
-            workPrimitive->flags.isFlat = 1;
-            workPrimitive->flags.isNonlit = 0;
-            workPrimitive->flags.isGradated = 0;
-            workPrimitive->flags.isGouraud = 0;
-            workPrimitive->flags.isTextured = 0;
+#define _TMD_PRIM_TYPE(flag, mode, ilen, vertexCount, attribs, gather) \
+    [TMD_PRIM_TYPE_INDEX(flag, mode)] = { ilen, vertexCount, attribs, gather }
+
+// Every known primitive type, indexed with TMD_PRIM_TYPE_INDEX
+const TmdPrimitiveType tmdPrimitiveTypes[256] = {
+    // Lit triangles
+    _TMD_PRIM_TYPE(0,            0x20,  3, 3, 0,
+        _TmdGatherTriangleFlat),
+    _TMD_PRIM_TYPE(TMD_FLAG_GRD, 0x20,  5, 3, TMD_PRIM_ATTRIB_GRADATED,
+        _TmdGatherTriangleGradated),
+    _TMD_PRIM_TYPE(0,            0x24,  5, 3, TMD_PRIM_ATTRIB_TEXTURED,
+        _TmdGatherTriangleTextured),
+    _TMD_PRIM_TYPE(0,            0x30,  4, 3, TMD_PRIM_ATTRIB_GOURAUD,
+        _TmdGatherTriangleGouraud),
+    _TMD_PRIM_TYPE(TMD_FLAG_GRD, 0x30,  6, 3, TMD_PRIM_ATTRIB_GOURAUD | TMD_PRIM_ATTRIB_GRADATED,
+        _TmdGatherTriangleGouraudGradated),
+    _TMD_PRIM_TYPE(0,            0x34,  6, 3, TMD_PRIM_ATTRIB_GOURAUD | TMD_PRIM_ATTRIB_TEXTURED,
+        _TmdGatherTriangleGouraudTextured),
+
+    // Nonlit triangles (gradation is implied by IIP)
+    _TMD_PRIM_TYPE(TMD_FLAG_LGT, 0x21,  3, 3, TMD_PRIM_ATTRIB_NONLIT,
+        _TmdGatherTriangleNonlit),
+    _TMD_PRIM_TYPE(TMD_FLAG_LGT, 0x31,  5, 3, TMD_PRIM_ATTRIB_NONLIT | TMD_PRIM_ATTRIB_GRADATED,
+        _TmdGatherTriangleNonlitGouraud),
+    _TMD_PRIM_TYPE(TMD_FLAG_LGT | TMD_FLAG_GRD, 0x31, 5, 3, TMD_PRIM_ATTRIB_NONLIT | TMD_PRIM_ATTRIB_GRADATED,
+        _TmdGatherTriangleNonlitGouraud),
+    _TMD_PRIM_TYPE(TMD_FLAG_LGT, 0x25,  6, 3, TMD_PRIM_ATTRIB_NONLIT | TMD_PRIM_ATTRIB_TEXTURED,
+        _TmdGatherTriangleNonlitTextured),
+    _TMD_PRIM_TYPE(TMD_FLAG_LGT, 0x35,  8, 3, TMD_PRIM_ATTRIB_NONLIT | TMD_PRIM_ATTRIB_GRADATED | TMD_PRIM_ATTRIB_TEXTURED,
+        _TmdGatherTriangleNonlitGouraudTextured),
+
+    // Lit quads
+    _TMD_PRIM_TYPE(0,            0x28,  4, 4, 0,
+        _TmdGatherQuadFlat),
+    _TMD_PRIM_TYPE(TMD_FLAG_GRD, 0x28,  7, 4, TMD_PRIM_ATTRIB_GRADATED,
+        _TmdGatherQuadGradated),
+    _TMD_PRIM_TYPE(0,            0x2C,  7, 4, TMD_PRIM_ATTRIB_TEXTURED,
+        _TmdGatherQuadTextured),
+    _TMD_PRIM_TYPE(0,            0x38,  5, 4, TMD_PRIM_ATTRIB_GOURAUD,
+        _TmdGatherQuadGouraud),
+    _TMD_PRIM_TYPE(TMD_FLAG_GRD, 0x38,  8, 4, TMD_PRIM_ATTRIB_GOURAUD | TMD_PRIM_ATTRIB_GRADATED,
+        _TmdGatherQuadGouraudGradated),
+    _TMD_PRIM_TYPE(0,            0x3C,  8, 4, TMD_PRIM_ATTRIB_GOURAUD | TMD_PRIM_ATTRIB_TEXTURED,
+        _TmdGatherQuadGouraudTextured),
+
+    // Nonlit quads
+    _TMD_PRIM_TYPE(TMD_FLAG_LGT, 0x29,  3, 4, TMD_PRIM_ATTRIB_NONLIT,
+        _TmdGatherQuadNonlit),
+    _TMD_PRIM_TYPE(TMD_FLAG_LGT, 0x39,  6, 4, TMD_PRIM_ATTRIB_NONLIT | TMD_PRIM_ATTRIB_GRADATED,
+        _TmdGatherQuadNonlitGouraud),
+    _TMD_PRIM_TYPE(TMD_FLAG_LGT | TMD_FLAG_GRD, 0x39, 6, 4, TMD_PRIM_ATTRIB_NONLIT | TMD_PRIM_ATTRIB_GRADATED,
+        _TmdGatherQuadNonlitGouraud),
+    _TMD_PRIM_TYPE(TMD_FLAG_LGT, 0x2D,  7, 4, TMD_PRIM_ATTRIB_NONLIT | TMD_PRIM_ATTRIB_TEXTURED,
+        _TmdGatherQuadNonlitTextured),
+    _TMD_PRIM_TYPE(TMD_FLAG_LGT, 0x3D, 10, 4, TMD_PRIM_ATTRIB_NONLIT | TMD_PRIM_ATTRIB_GRADATED | TMD_PRIM_ATTRIB_TEXTURED,
+        _TmdGatherQuadNonlitGouraudTextured),
+
+    // Lines are never lit
+    _TMD_PRIM_TYPE(0,            0x40,  2, 2, TMD_PRIM_ATTRIB_LINE | TMD_PRIM_ATTRIB_NONLIT,
+        _TmdGatherLineFlat),
+    _TMD_PRIM_TYPE(TMD_FLAG_LGT, 0x40,  2, 2, TMD_PRIM_ATTRIB_LINE | TMD_PRIM_ATTRIB_NONLIT,
+        _TmdGatherLineFlat),
+    _TMD_PRIM_TYPE(0,            0x50,  3, 2, TMD_PRIM_ATTRIB_LINE | TMD_PRIM_ATTRIB_NONLIT | TMD_PRIM_ATTRIB_GRADATED,
+        _TmdGatherLineGradated),
+    _TMD_PRIM_TYPE(TMD_FLAG_LGT, 0x50,  3, 2, TMD_PRIM_ATTRIB_LINE | TMD_PRIM_ATTRIB_NONLIT | TMD_PRIM_ATTRIB_GRADATED,
+        _TmdGatherLineGradated),
+};
+
+const TmdPrimitiveType* TmdGetPrimitiveType(TmdPrimitiveHeader* primitiveHeader) {
+    return tmdPrimitiveTypes + TMD_PRIM_TYPE_INDEX(primitiveHeader->flag, primitiveHeader->mode);
+}
 
-            memcpy(workPrimitive->rgb0, line->rgb, 3);
-            memcpy(workPrimitive->rgb1, line->rgb, 3);
-            memcpy(workPrimitive->rgb2, line->rgb, 3);
+// Number of work primitives a primitive of this type decodes into (quads are split in two)
+#define TMD_PRIM_TYPE_WORK_COUNT(type) ((type)->vertexCount == 4 ? 2 : 1)
+
+// Append gathered corners to out. Returns the amount of work primitives added, 0 if the
+// primitive references vertices or normals outside of the object's tables.
+u32 _TmdEmitPrimitive(
+    const TmdPrimitiveType* type, TmdPrimitiveCorners* corners,
+    u32 vertexCount, u32 normalCount, WorkPrimitives* out
+) {
+    // Triangle corner order; the second one is only used by quads, lines repeat their end
+    static const u8 triangleCorners[2][3] = { { 0, 1, 2 }, { 1, 3, 2 } };
+    static const u8 lineCorners[3] = { 0, 1, 1 };
+
+    const int hasNormals = !(type->attribs & TMD_PRIM_ATTRIB_NONLIT);
+    const int isTextured = !!(type->attribs & TMD_PRIM_ATTRIB_TEXTURED);
+
+    for (unsigned i = 0; i < type->vertexCount; i++) {
+        if (corners->vertexIndexes[i] >= vertexCount)
+            return 0;
+        if (hasNormals && corners->normalIndexes[i] >= normalCount)
+            return 0;
+    }
 
-            memcpy(workPrimitive->vertices[0], v0, sizeof(TmdVertex));
-            memcpy(workPrimitive->vertices[1], v1, sizeof(TmdVertex));
-            memcpy(workPrimitive->vertices[2], v1, sizeof(TmdVertex));
+    // The VRAM image is in 4-bit units, so 8-bit texels span 2 columns and 15-bit ones 4
+    u16 pageX = 0, pageY = 0, uScale = 1;
+    if (isTextured) {
+        u32 tpage = TSB_GET_TPAGE(corners->tsb);
 
-            memset(workPrimitive->normals, 0, sizeof(float) * 3 * 3);
+        pageX = (tpage * VR_PAGE_WIDTH32) % VR_WIDTH32;
+        pageY = tpage >= 16 ? VR_PAGE_HEIGHT : 0;
 
-            workPrimitive->flags.OK = 1;
-        } break;
+        uScale = 1 << MIN(TSB_GET_TPF(corners->tsb), 2);
+    }
 
-        case HASH_PRIMITIVE_ATTRIBS(1, 0x21): {
-            TmdTriangleNonlit* tri = (TmdTriangleNonlit*)currentPrimitiveData;
+    u32 workCount = TMD_PRIM_TYPE_WORK_COUNT(type);
+    for (unsigned t = 0; t < workCount; t++) {
+        u32 p = out->count++;
 
-            TmdVertex* v0 = vertices + tri->vertexIndexes[0];
-            TmdVertex* v1 = vertices + tri->vertexIndexes[1];
-            TmdVertex* v2 = vertices + tri->vertexIndexes[2];
+        const u8* cornerOrder = (type->attribs & TMD_PRIM_ATTRIB_LINE) ? lineCorners : triangleCorners[t];
 
-            workPrimitive->flags.isFlat = 0;
-            workPrimitive->flags.isNonlit = 1;
-            workPrimitive->flags.isGradated = 0;
-            workPrimitive->flags.isGouraud = 0;
-            workPrimitive->flags.isTextured = 0;
+        for (unsigned j = 0; j < 3; j++) {
+            unsigned c = cornerOrder[j];
 
-            memcpy(workPrimitive->rgb0, tri->rgb, 3);
-            memcpy(workPrimitive->rgb1, tri->rgb, 3);
-            memcpy(workPrimitive->rgb2, tri->rgb, 3);
+            out->vertexIndexes[p][j] = corners->vertexIndexes[c];
+            out->normalIndexes[p][j] = hasNormals ? corners->normalIndexes[c] : 0;
 
-            memcpy(workPrimitive->vertices[0], v0, sizeof(TmdVertex));
-            memcpy(workPrimitive->vertices[1], v1, sizeof(TmdVertex));
-            memcpy(workPrimitive->vertices[2], v2, sizeof(TmdVertex));
+            if (isTextured) {
+                out->uvs[p][j][0] = pageX + corners->uv[c][0] * uScale;
+                out->uvs[p][j][1] = pageY + corners->uv[c][1];
+            }
+            else
+                memcpy(out->colors[p][j], corners->rgb[c], 3);
+        }
 
-            memset(workPrimitive->normals, 0, sizeof(float) * 3 * 3);
+        out->tsbs[p] = corners->tsb;
+        out->cbas[p] = corners->cba;
+        out->attribs[p] = type->attribs;
+    }
 
-            workPrimitive->flags.OK = 1;
-        } break;
+    return workCount;
+}
 
-        case HASH_PRIMITIVE_ATTRIBS(1, 0x25): {
-            TmdTriangleNonlitTextured* tri = (TmdTriangleNonlitTextured*)currentPrimitiveData;
+typedef struct {
+    u32 workPrimitiveCount;
 
-            TmdVertex* v0 = vertices + tri->vertexIndexes[0];
-            TmdVertex* v1 = vertices + tri->vertexIndexes[1];
-            TmdVertex* v2 = vertices + tri->vertexIndexes[2];
+    u32 triangleCount;
+    u32 lineCount;
 
-            //u32 cbx = CBA_GET_CBX(tri->cba);
-            //u32 cby = CBA_GET_CBY(tri->cba);
+    // Mesh sizes; triangles use 3 vertices, lines 2 (indexed as a degenerate triangle)
+    u32 vertexCount;
+    u32 indexCount;
+} TmdObjectCounts;
 
-            u32 tpage = TSB_GET_TPAGE(tri->tsb);
+// Walk only the primitive headers and size everything the object decodes into. Primitives that
+// turn out to be malformed while decoding are still counted, so these are upper bounds.
+TmdObjectCounts TmdObjectGetCounts(u8* tmdData, u32 objectIndex) {
+    TmdObjectHeader* objectHeader = GET_TMD_OBJECT_HEADER(tmdData, objectIndex);
 
-            u16 pageX = (tpage * VR_PAGE_WIDTH32) % VR_WIDTH32;
-            u16 pageY = tpage >= 16 ? VR_PAGE_HEIGHT : 0;
+    TmdObjectCounts counts = { 0 };
 
-            workPrimitive->flags.isFlat = 0;
-            workPrimitive->flags.isNonlit = 1;
-            workPrimitive->flags.isGradated = 0;
-            workPrimitive->flags.isGouraud = 0;
-            workPrimitive->flags.isTextured = 1;
+    TmdPrimitiveHeader* primitiveHeader =
+        (TmdPrimitiveHeader*)(tmdData + sizeof(TmdFileHeader) + objectHeader->primitivesOffset);
+    for (unsigned i = 0; i < objectHeader->primitiveCount; i++) {
+        const TmdPrimitiveType* type = TmdGetPrimitiveType(primitiveHeader);
+
+        if (type->gather && primitiveHeader->ilen >= type->ilen) {
+            u32 workCount = TMD_PRIM_TYPE_WORK_COUNT(type);
+            counts.workPrimitiveCount += workCount;
+
+            if (type->attribs & TMD_PRIM_ATTRIB_LINE) {
+                counts.lineCount++;
+                counts.vertexCount += 2;
+            }
+            else {
+                counts.triangleCount += workCount;
+                counts.vertexCount += workCount * 3;
+            }
+            counts.indexCount += workCount * 3;
+        }
 
-            memcpy(workPrimitive->rgb0, tri->rgb, 3);
-            memcpy(workPrimitive->rgb1, tri->rgb, 3);
-            memcpy(workPrimitive->rgb2, tri->rgb, 3);
+        primitiveHeader = (TmdPrimitiveHeader*)(
+            (u8*)(primitiveHeader + 1) + (primitiveHeader->ilen * 4)
+        );
+    }
 
-            memcpy(workPrimitive->vertices[0], v0, sizeof(TmdVertex));
-            memcpy(workPrimitive->vertices[1], v1, sizeof(TmdVertex));
-            memcpy(workPrimitive->vertices[2], v2, sizeof(TmdVertex));
+    return counts;
+}
 
-            memset(workPrimitive->normals, 0, sizeof(float) * 3 * 3);
+// workPrimitives must have room for TmdObjectGetCounts().workPrimitiveCount entries; they replace
+// its contents. Unsupported or malformed primitives are skipped; returns the amount decoded.
+u32 TmdObjectDecodeWorkPrimitives(u8* tmdData, u32 objectIndex, WorkPrimitives* workPrimitives) {
+    TmdObjectHeader* objectHeader = GET_TMD_OBJECT_HEADER(tmdData, objectIndex);
 
-            workPrimitive->uv0[0] = pageX + tri->uv0[0];
-            workPrimitive->uv0[1] = pageY + tri->uv0[1];
-            workPrimitive->uv1[0] = pageX + tri->uv1[0];
-            workPrimitive->uv1[1] = pageY + tri->uv1[1];
-            workPrimitive->uv2[0] = pageX + tri->uv2[0];
-            workPrimitive->uv2[1] = pageY + tri->uv2[1];
+    workPrimitives->count = 0;
 
-            // TODO: figure this out
-            workPrimitive->tsb = tri->tsb;
+    TmdPrimitiveHeader* primitiveHeader =
+        (TmdPrimitiveHeader*)(tmdData + sizeof(TmdFileHeader) + objectHeader->primitivesOffset);
+    for (unsigned i = 0; i < objectHeader->primitiveCount; i++) {
+        const TmdPrimitiveType* type = TmdGetPrimitiveType(primitiveHeader);
 
-            workPrimitive->flags.OK = 1;
-        } break;
+        // The packet must be at least as long as the type expects (TmdPreprocess validated ilen)
+        if (type->gather && primitiveHeader->ilen >= type->ilen) {
+            // Untextured types gather no tsb & cba, leave them 0
+            TmdPrimitiveCorners corners = { 0 };
+            type->gather(primitiveHeader + 1, &corners);
 
-        default:
-            workPrimitive->flags.OK = 0;
-            break;
+            _TmdEmitPrimitive(
+                type, &corners, objectHeader->vertexCount, objectHeader->normalCount, workPrimitives
+            );
         }
 
         primitiveHeader = (TmdPrimitiveHeader*)(
@@ -495,7 +1111,7 @@ WorkPrimitive* TmdObjectCreateWorkPrimitives(u8* tmdData, u32 objectIndex) {
         );
     }
 
-    return workPrimitives;
+    return workPrimitives->count;
 }
 
 #endif
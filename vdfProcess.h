@@ -3,8 +3,12 @@
 
 #include "tmdProcess.h"
 
+#include "simd.h"
+
 #include <stdio.h>
+#include <stdlib.h>
 
+#include "allocStats.h"
 #include "common.h"
 
 typedef struct __attribute((packed)) {
@@ -26,35 +30,185 @@ typedef struct __attribute((packed)) {
     VdfKey firstKey[0];
 } VdfFileHeader;
 
-void VdfPreprocess(u8* vdfData) {}
+// Float positions (structure-of-arrays) of a vertex table that VDF keys are blended into.
+// They can cover only part of the table, x[0] then being the position of vertex `first`.
+typedef struct {
+    float* x;
+    float* y;
+    float* z;
+
+    u32 first;
+} VdfPositions;
+
+typedef struct {
+    u8* _vdfData; // Read-only VDF data (not owned, must outlive this)
+
+    u32 keyCount;
+    VdfKey** keys; // Pointer to every key, so any key can be accessed in constant time
+
+    // Per key; the key's deltas converted to floats in SoA layout for the blend kernels.
+    // All of them live in the single _deltaData block.
+    VdfPositions* deltas;
+    float* _deltaData;
+} VdfData;
+
+// dst[i] += delta[i] * influence
+typedef void (*VdfBlendFunc)(float* dst, const float* delta, u32 count, float influence);
+
+void _VdfBlendScalar(float* dst, const float* delta, u32 count, float influence) {
+    for (u32 i = 0; i < count; i++)
+        dst[i] += delta[i] * influence;
+}
+
+#ifdef SIMD_X86
+__attribute__((target("sse2")))
+void _VdfBlendSse2(float* dst, const float* delta, u32 count, float influence) {
+    __m128 vInfluence = _mm_set1_ps(influence);
+
+    u32 i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 d = _mm_mul_ps(_mm_loadu_ps(delta + i), vInfluence);
+        _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), d));
+    }
 
-u32 VdfGetKeyCount(u8* vdfData) {
-    return ((VdfFileHeader*)vdfData)->keyCount;
+    _VdfBlendScalar(dst + i, delta + i, count - i, influence);
 }
 
-VdfKey* _VdfGetKeyFromIndex(u8* vdfData, u32 keyIndex) {
-    VdfKey* key = ((VdfFileHeader*)vdfData)->firstKey;
-    for (unsigned i = 0; i < keyIndex; i++)
-        key = (VdfKey*)((u8*)(key + 1) + key->vertexCount * sizeof(VdfVertex));
+__attribute__((target("avx2")))
+void _VdfBlendAvx2(float* dst, const float* delta, u32 count, float influence) {
+    __m256 vInfluence = _mm256_set1_ps(influence);
 
-    return key;
+    u32 i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 d = _mm256_mul_ps(_mm256_loadu_ps(delta + i), vInfluence);
+        _mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_loadu_ps(dst + i), d));
+    }
+
+    _VdfBlendScalar(dst + i, delta + i, count - i, influence);
 }
+#endif
 
-u32 VdfGetKeyObjectIndex(u8* vdfData, u32 keyIndex) {
-    return (_VdfGetKeyFromIndex(vdfData, keyIndex))->objectIndex;
+VdfBlendFunc vdfBlend = NULL; // Picked by VdfPreprocess
+
+VdfBlendFunc _VdfSelectBlend(void) {
+#ifdef SIMD_X86
+    if (SimdHasAvx2())
+        return _VdfBlendAvx2;
+    if (SimdHasSse2())
+        return _VdfBlendSse2;
+#endif
+    return _VdfBlendScalar;
 }
 
-void VdfApply(u8* vdfData, u32 keyIndex, float influence, TmdVertex* vertices) {
-    VdfKey* key = _VdfGetKeyFromIndex(vdfData, keyIndex);
+// Validates the key chain against the file size, indexes every key and converts the deltas
+// for blending. Free with VdfDestroy.
+VdfData* VdfPreprocess(u8* vdfData, u64 vdfDataSize) {
+    if (vdfDataSize < sizeof(VdfFileHeader))
+        panic("VDF file is too small");
+
+    VdfData* vdf = (VdfData*)CountedMalloc(sizeof(VdfData));
+    vdf->_vdfData = vdfData;
+
+    vdf->keyCount = ((VdfFileHeader*)vdfData)->keyCount;
+
+    // Every key takes at least a header, bound the count before allocating for it
+    if ((vdfDataSize - sizeof(VdfFileHeader)) / sizeof(VdfKey) < vdf->keyCount)
+        panic("VDF key count is out of bounds");
+
+    vdf->keys = (VdfKey**)CountedMalloc(vdf->keyCount * sizeof(VdfKey*));
+
+    u64 totalDeltas = 0;
+
+    u64 keyOffset = sizeof(VdfFileHeader);
+    for (unsigned i = 0; i < vdf->keyCount; i++) {
+        if (vdfDataSize - keyOffset < sizeof(VdfKey))
+            panic("VDF key header is out of bounds");
+
+        VdfKey* key = (VdfKey*)(vdfData + keyOffset);
+        keyOffset += sizeof(VdfKey);
 
-    TmdVertex* vertex = (TmdVertex*)((u8*)vertices + key->firstVertex);
-    for (unsigned i = 0; i < key->vertexCount; i++, vertex++) {
-        VdfVertex* vdfVertex = key->vertices + i;
+        if ((vdfDataSize - keyOffset) / sizeof(VdfVertex) < key->vertexCount)
+            panic("VDF key vertices are out of bounds");
+        if (key->firstVertex % sizeof(TmdVertex))
+            panic("VDF key vertex offset is misaligned");
+        // The range's end must be representable, or it can't be checked against a vertex table
+        if (key->vertexCount > 0xFFFFFFFFu - key->firstVertex / sizeof(TmdVertex))
+            panic("VDF key vertex range overflows");
 
-        vertex->x += (vdfVertex->x * influence);
-        vertex->y += (vdfVertex->y * influence);
-        vertex->z += (vdfVertex->z * influence);
+        keyOffset += (u64)key->vertexCount * sizeof(VdfVertex);
+
+        vdf->keys[i] = key;
+        totalDeltas += key->vertexCount;
+    }
+
+    vdf->deltas = (VdfPositions*)CountedMalloc(vdf->keyCount * sizeof(VdfPositions));
+    vdf->_deltaData = (float*)CountedMalloc(totalDeltas * 3 * sizeof(float));
+
+    float* deltaData = vdf->_deltaData;
+    for (unsigned i = 0; i < vdf->keyCount; i++) {
+        VdfKey* key = vdf->keys[i];
+        VdfPositions* deltas = vdf->deltas + i;
+
+        deltas->x = deltaData;
+        deltas->y = deltas->x + key->vertexCount;
+        deltas->z = deltas->y + key->vertexCount;
+        deltaData = deltas->z + key->vertexCount;
+
+        for (unsigned j = 0; j < key->vertexCount; j++) {
+            deltas->x[j] = key->vertices[j].x;
+            deltas->y[j] = key->vertices[j].y;
+            deltas->z[j] = key->vertices[j].z;
+        }
     }
+
+    if (vdfBlend == NULL)
+        vdfBlend = _VdfSelectBlend();
+
+    return vdf;
+}
+
+void VdfDestroy(VdfData* vdf) {
+    CountedFree(vdf->keys);
+    CountedFree(vdf->deltas);
+    CountedFree(vdf->_deltaData);
+    CountedFree(vdf);
+}
+
+u32 VdfGetKeyCount(VdfData* vdf) {
+    return vdf->keyCount;
+}
+
+VdfKey* _VdfGetKeyFromIndex(VdfData* vdf, u32 keyIndex) {
+    if (keyIndex >= vdf->keyCount)
+        panic("VDF key index is out of bounds");
+
+    return vdf->keys[keyIndex];
+}
+
+u32 VdfGetKeyObjectIndex(VdfData* vdf, u32 keyIndex) {
+    return (_VdfGetKeyFromIndex(vdf, keyIndex))->objectIndex;
+}
+
+// Range of the target object's vertex table touched by a key, as [first, end)
+void VdfGetKeyVertexRange(VdfData* vdf, u32 keyIndex, u32* firstOut, u32* endOut) {
+    VdfKey* key = _VdfGetKeyFromIndex(vdf, keyIndex);
+
+    // firstVertex is a byte offset into the vertex table
+    *firstOut = key->firstVertex / sizeof(TmdVertex);
+    *endOut = *firstOut + key->vertexCount;
+}
+
+// Accumulate a key into the positions of its target object, which must cover the key's vertex
+// range. Nothing is rounded, so any number of keys can be blended before the result is written out.
+void VdfApply(VdfData* vdf, u32 keyIndex, float influence, VdfPositions* positions) {
+    VdfKey* key = _VdfGetKeyFromIndex(vdf, keyIndex);
+    VdfPositions* deltas = vdf->deltas + keyIndex;
+
+    u32 first = key->firstVertex / sizeof(TmdVertex) - positions->first;
+
+    vdfBlend(positions->x + first, deltas->x, key->vertexCount, influence);
+    vdfBlend(positions->y + first, deltas->y, key->vertexCount, influence);
+    vdfBlend(positions->z + first, deltas->z, key->vertexCount, influence);
 }
 
 #endif
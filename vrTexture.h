@@ -0,0 +1,192 @@
+#ifndef VR_TEXTURE_H
+#define VR_TEXTURE_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <raylib.h>
+
+#include "timProcess.h"
+
+#include "allocStats.h"
+#include "common.h"
+
+// CPU image of VRAM with the GPU texture made from it. The rectangles TIMs write are tracked,
+// so once the texture exists only those get uploaded again.
+
+typedef struct {
+    u16 x, y, width, height; // In texture pixels
+} VrRect;
+
+typedef struct {
+    int native; // Raw 16-bit VRAM (TimVrCopy16) instead of the RGBA image (TimVrCopy)
+
+    Image image;
+    Texture2D texture; // id 0 until the first upload
+
+    // Written since the last VrTextureClear, and not uploaded yet
+    VrRect* _rects;
+    u32 _rectCount, _rectCapacity;
+    VrRect* _dirtyRects;
+    u32 _dirtyCount, _dirtyCapacity;
+
+    u8* _scratch; // Packed rows of a rectangle, for UpdateTextureRec
+    u64 _scratchSize;
+} VrTexture;
+
+VrTexture* VrTextureCreate(int native) {
+    VrTexture* vt = (VrTexture*)CountedCalloc(1, sizeof(VrTexture));
+    vt->native = native;
+
+    vt->image.mipmaps = 1;
+    if (native) {
+        // The words go up unchanged as R5G5B5A1 texels; VRAM_SHADER reassembles them
+        vt->image.format = PIXELFORMAT_UNCOMPRESSED_R5G5B5A1;
+        vt->image.width = VR_WIDTH;
+    }
+    else {
+        vt->image.format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8;
+        vt->image.width = VR_WIDTH32;
+    }
+    vt->image.height = VR_HEIGHT;
+    vt->image.data = CountedCalloc(vt->image.width * vt->image.height, native ? sizeof(u16) : sizeof(u32));
+
+    return vt;
+}
+
+// Frees the CPU side only; the texture belongs to whatever material it was applied to
+void VrTextureDestroy(VrTexture* vt) {
+    CountedFree(vt->image.data);
+
+    CountedFree(vt->_rects);
+    CountedFree(vt->_dirtyRects);
+    CountedFree(vt->_scratch);
+
+    CountedFree(vt);
+}
+
+u32 _VrTexturePixelSize(VrTexture* vt) {
+    return vt->native ? sizeof(u16) : sizeof(u32);
+}
+
+void _VrRectListAdd(VrRect** rects, u32* count, u32* capacity, VrRect rect) {
+    // Re-adding a TIM (the usual case) gives the same rectangle
+    for (u32 i = 0; i < *count; i++) {
+        if (memcmp(*rects + i, &rect, sizeof(VrRect)) == 0)
+            return;
+    }
+
+    if (*count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 16;
+        *rects = (VrRect*)CountedRealloc(*rects, *capacity * sizeof(VrRect));
+    }
+    (*rects)[(*count)++] = rect;
+}
+
+// rect is in VRAM words
+void _VrTextureAddRect(VrTexture* vt, u16 fbX, u16 fbY, u16 width, u16 height) {
+    if (width == 0 || height == 0)
+        return;
+
+    VrRect rect = { fbX, fbY, width, height };
+    if (!vt->native) {
+        rect.x *= 4;
+        rect.width *= 4;
+    }
+
+    _VrRectListAdd(&vt->_rects, &vt->_rectCount, &vt->_rectCapacity, rect);
+    _VrRectListAdd(&vt->_dirtyRects, &vt->_dirtyCount, &vt->_dirtyCapacity, rect);
+}
+
+// Composite a preprocessed TIM into the image
+void VrTextureAddTim(VrTexture* vt, u8* timData) {
+    TimFileHeader* fileHeader = (TimFileHeader*)timData;
+    TimPixelHeader* pixelHeader = _TimGetPixelHeader(fileHeader);
+
+    if (vt->native) {
+        TimVrCopy16(timData, (u16*)vt->image.data);
+
+        TimCLUTHeader* clutHeader = _TimGetClutHeader(fileHeader);
+        if (clutHeader)
+            _VrTextureAddRect(vt, clutHeader->fbX, clutHeader->fbY, clutHeader->width, clutHeader->height);
+    }
+    else
+        TimVrCopy(timData, (u8*)vt->image.data);
+
+    _VrTextureAddRect(vt, pixelHeader->fbX, pixelHeader->fbY, pixelHeader->width, pixelHeader->height);
+}
+
+// Composite preprocessed TIMs into the image in order, decoding them on up to threadCount threads
+void VrTextureAddTims(VrTexture* vt, u8** timDatas, u32 timCount, u32 threadCount) {
+    if (vt->native) {
+        // Nothing to decode, the TIMs are only copied
+        for (u32 i = 0; i < timCount; i++)
+            VrTextureAddTim(vt, timDatas[i]);
+        return;
+    }
+
+    TimVrCopyMany(timDatas, timCount, (u8*)vt->image.data, threadCount);
+
+    for (u32 i = 0; i < timCount; i++) {
+        TimPixelHeader* pixelHeader = _TimGetPixelHeader((TimFileHeader*)timDatas[i]);
+        _VrTextureAddRect(vt, pixelHeader->fbX, pixelHeader->fbY, pixelHeader->width, pixelHeader->height);
+    }
+}
+
+// Clear everything TIMs wrote since the last clear, e.g. before adding them again
+void VrTextureClear(VrTexture* vt) {
+    u32 pixelSize = _VrTexturePixelSize(vt);
+
+    for (u32 i = 0; i < vt->_rectCount; i++) {
+        VrRect* rect = vt->_rects + i;
+
+        for (u32 row = 0; row < rect->height; row++) {
+            u8* dst = (u8*)vt->image.data + ((u64)(rect->y + row) * vt->image.width + rect->x) * pixelSize;
+            memset(dst, 0, rect->width * pixelSize);
+        }
+
+        _VrRectListAdd(&vt->_dirtyRects, &vt->_dirtyCount, &vt->_dirtyCapacity, *rect);
+    }
+
+    vt->_rectCount = 0;
+}
+
+// Create the texture, or update the rectangles changed since the last upload. Returns the number
+// of bytes uploaded.
+u64 VrTextureUpload(VrTexture* vt) {
+    u32 pixelSize = _VrTexturePixelSize(vt);
+
+    if (vt->texture.id == 0) {
+        vt->texture = LoadTextureFromImage(vt->image);
+        vt->_dirtyCount = 0;
+
+        return (u64)vt->image.width * vt->image.height * pixelSize;
+    }
+
+    u64 uploaded = 0;
+    for (u32 i = 0; i < vt->_dirtyCount; i++) {
+        VrRect* rect = vt->_dirtyRects + i;
+
+        u64 rowSize = rect->width * pixelSize;
+        u64 size = rowSize * rect->height;
+        if (size > vt->_scratchSize) {
+            vt->_scratch = (u8*)CountedRealloc(vt->_scratch, size);
+            vt->_scratchSize = size;
+        }
+
+        for (u32 row = 0; row < rect->height; row++) {
+            u8* src = (u8*)vt->image.data + ((u64)(rect->y + row) * vt->image.width + rect->x) * pixelSize;
+            memcpy(vt->_scratch + row * rowSize, src, rowSize);
+        }
+
+        Rectangle rec = { rect->x, rect->y, rect->width, rect->height };
+        UpdateTextureRec(vt->texture, rec, vt->_scratch);
+
+        uploaded += size;
+    }
+    vt->_dirtyCount = 0;
+
+    return uploaded;
+}
+
+#endif